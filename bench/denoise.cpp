@@ -0,0 +1,75 @@
+// Time of Denoiser::apply() on a 1920x1080 frame: a synthetic G-buffer of planes and spheres with noisy colors,
+// about what a frame traced at one sample per pixel looks like. Iteration counts are given on the command line, by
+// default 1 to 5; OMP_NUM_THREADS sets the threads. The hash of the output tells builds that filter differently apart
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "denoise.h"
+
+int main(int argc, char** argv) {
+    const int w = 1920, h = 1080;
+    std::vector<int> counts;
+    for (int a = 1; a < argc; a++) counts.push_back(std::max(1, std::atoi(argv[a])));
+    if (counts.empty()) counts = {1, 2, 3, 4, 5};
+
+    GBuffer gbuffer;
+    gbuffer.resize(size_t(w) * h);
+    std::vector<Vec3f> noisy(size_t(w) * h), image(noisy.size());
+    uint32_t state = 1;
+    auto random = [&state]() { state = state * 1664525u + 1013904223u; return (state >> 8) * (1.f / 16777216.f); }; // [0, 1)
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            const size_t p = size_t(y) * w + x;
+            PrimaryHit hit;
+            const float u = (x % 480) / 240.f - 1, v = (y % 360) / 180.f - 1;
+            if (y < h / 8) {} // sky
+            else if (u * u + v * v < 1) { // a sphere in every cell, facing the camera
+                hit.N = Vec3f(u, v, std::sqrt(1 - u * u - v * v));
+                hit.depth = 10 - 2 * hit.N.z;
+                hit.albedo = Vec3f(.6f, .3f, .1f);
+            }
+            else { // the floor behind them
+                hit.N = Vec3f(0, 1, 0);
+                hit.depth = 20 + y * .01f;
+                hit.albedo = Vec3f(.3f, .3f, .3f);
+            }
+            gbuffer.write(p, hit);
+            const float light = hit.N.y * .5f + .5f, n = .7f + .6f * random(); // 1 spp worth of noise
+            noisy[p] = hit.albedo * (light * n);
+        }
+    }
+
+    int threads = 1;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#endif
+    std::printf("%dx%d, %d thread(s)\niterations  best ms  per iteration  output hash\n", w, h, threads);
+    for (int iterations : counts) {
+        Denoiser denoiser;
+        denoiser.iterations = iterations;
+        double best = 1e30;
+        for (int r = 0; r < 5; r++) {
+            image = noisy;
+            auto start = std::chrono::steady_clock::now();
+            denoiser.apply(image.data(), gbuffer, w, h, w);
+            best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        }
+        uint64_t hash = 14695981039346656037u; // FNV-1a of the bits
+        for (const Vec3f& c : image) {
+            for (size_t i = 0; i < 3; i++) {
+                uint32_t bits;
+                std::memcpy(&bits, &c[i], sizeof(bits));
+                for (int b = 0; b < 32; b += 8) hash = (hash ^ ((bits >> b) & 255)) * 1099511628211u;
+            }
+        }
+        std::printf("%10d  %7.1f  %13.1f  %016llx\n", iterations, best, best / iterations, (unsigned long long)hash);
+    }
+    return 0;
+}
@@ -0,0 +1,46 @@
+// Throughput of the fast-math approximations of geometry.h against the exact functions they replace with
+// TINYRT_FAST_MATH: the normalization of vectors and the specular power. Inputs and results are arrays, so calls
+// are independent and the loop measures throughput; the results are summed afterwards so none is optimized away
+#include <cmath>
+#include <cstdio>
+#include <chrono>
+#include <vector>
+#include "geometry.h"
+
+template <typename F> void measure(const char* name, size_t n, int reps, F f) {
+    static std::vector<float> out;
+    out.resize(n);
+    double best = 1e30, sum = 0;
+    for (int r = 0; r < reps; r++) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < n; i++) out[i] = f(i);
+        best = std::min(best, std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / n);
+    }
+    for (size_t i = 0; i < n; i++) sum += out[i];
+    std::printf("%-26s %6.2f ns/call  %7.1f M/s  (checksum %g)\n", name, best, 1e3 / best, sum);
+}
+
+int main() {
+    const size_t n = 1 << 20;
+    std::vector<Vec3f> v(n);
+    std::vector<float> x(n);
+    uint32_t state = 1;
+    auto random = [&state]() { state = state * 1664525u + 1013904223u; return (state >> 8) * (1.f / 16777216.f); }; // [0, 1)
+    for (size_t i = 0; i < n; i++) {
+        v[i] = Vec3f(random() * 2 - 1, random() * 2 - 1, random() * 2 - 1);
+        x[i] = random();
+    }
+
+    measure("1/sqrtf", n, 20, [&](size_t i) { return 1 / std::sqrt(x[i] + 1e-3f); });
+    measure("fast_rsqrt", n, 20, [&](size_t i) { return fast_rsqrt(x[i] + 1e-3f); });
+    measure("normalize, exact", n, 20, [&](size_t i) { Vec3f u = v[i] * (1 / std::sqrt(v[i] * v[i])); return u.x + u.y + u.z; });
+    measure("normalize, fast_rsqrt", n, 20, [&](size_t i) { Vec3f u = v[i] * fast_rsqrt(v[i] * v[i]); return u.x + u.y + u.z; });
+    for (float e : {10.f, 50.f, 1425.f}) {
+        char exact[32], fast[32];
+        std::snprintf(exact, sizeof(exact), "powf, e = %g", e);
+        std::snprintf(fast, sizeof(fast), "fast_pow, e = %g", e);
+        measure(exact, n, 20, [&](size_t i) { return powf(x[i], e); });
+        measure(fast, n, 20, [&](size_t i) { return fast_pow(x[i], e); });
+    }
+    return 0;
+}
@@ -0,0 +1,71 @@
+// Throughput of the ray queue under contention: every thread pushes and pops the shared MPMCQueue in turn, or
+// passes chunks through a RayStream's free and full queues the way render_stream() does. Thread counts are given
+// on the command line (1 to 64), by default 1, 2, 4, ... 64
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include "rayqueue.h"
+
+// Best of reps runs of every thread calling f(thread) at once, in ns
+template <typename F> double measure(int threads, int reps, F f) {
+    double best = 1e30;
+    for (int r = 0; r < reps; r++) {
+        std::atomic<int> ready{0};
+        std::vector<std::thread> pool;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < threads; i++) pool.emplace_back([&, i]() {
+            ready.fetch_add(1);
+            while (ready.load() < threads) std::this_thread::yield(); // start together
+            f(i);
+        });
+        for (std::thread& t : pool) t.join();
+        best = std::min(best, std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+int main(int argc, char** argv) {
+    std::vector<int> counts;
+    for (int a = 1; a < argc; a++) counts.push_back(std::max(1, std::min(64, std::atoi(argv[a]))));
+    if (counts.empty()) counts = {1, 2, 4, 8, 16, 32, 64};
+    const long ops = 1 << 20; // per run, split across the threads
+
+    std::printf("threads  push+pop pairs          chunk round trips\n");
+    for (int threads : counts) {
+        const long per_thread = ops / threads;
+
+        // Half full, so neither push nor pop runs into the ends
+        MPMCQueue<uint32_t> queue(1024);
+        for (uint32_t i = 0; i < 512; i++) queue.push(i);
+        const double queue_ns = measure(threads, 5, [&](int) {
+            uint32_t v = 0;
+            for (long k = 0; k < per_thread; k++) {
+                while (!queue.push(v)) std::this_thread::yield();
+                while (!queue.pop(v)) std::this_thread::yield();
+            }
+        });
+
+        // acquire, submit, pop the filled chunk, release: the queue traffic of one chunk of rays
+        RayStream stream(1024);
+        const double stream_ns = measure(threads, 5, [&](int) {
+            for (long k = 0; k < per_thread; k++) {
+                int c;
+                while ((c = stream.acquire()) < 0) std::this_thread::yield();
+                stream.chunks[c].size = 1;
+                stream.submit(c);
+                uint32_t full;
+                while (!stream.full_chunks.pop(full)) std::this_thread::yield();
+                stream.release(int(full));
+            }
+        });
+
+        const long done = per_thread * threads;
+        std::printf("%7d  %6.1f M/s %7.1f ns     %6.1f M/s %7.1f ns\n", threads,
+                    done * 1e3 / queue_ns, queue_ns / done, done * 1e3 / stream_ns, stream_ns / done);
+    }
+    return 0;
+}
@@ -0,0 +1,559 @@
+#ifndef __BVH_H__
+#define __BVH_H__
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#include "geometry.h"
+#include "hugepage.h"
+
+inline void prefetch(const void* p) {
+#if defined(__SSE2__) || defined(_M_X64)
+    _mm_prefetch(static_cast<const char*>(p), _MM_HINT_T0);
+#else
+    (void)p;
+#endif
+}
+
+// Binary BVH over primitives with bmin/bmax bounds and ray_intersect(orig, dir, t).
+// Three parallel builders:
+//  - BVH_LBVH:   Morton-sorted primitives split at the highest differing code bit, fastest to build
+//  - BVH_SAH:    binned SAH with task parallel recursion, best trees
+//  - BVH_HYBRID: binned SAH for the top of the tree, LBVH treelets below treelet_size primitives
+enum BVHBuilder { BVH_LBVH, BVH_SAH, BVH_HYBRID, BVH_BUILDER_COUNT };
+
+struct BVHNode {
+    Vec3f bmin;
+    uint32_t first; // leaf: first entry in prim_ids, inner node: left child (the right one is first + 1)
+    Vec3f bmax;
+    uint32_t count; // primitives in the leaf, 0 for inner nodes
+};
+
+struct BVH {
+    HugeVector<BVHNode> nodes;     // nodes[0] is the root
+    HugeVector<uint32_t> prim_ids; // leaves reference contiguous ranges of this array
+    int prefetch_distance = 0;     // traversal prefetches what the stack entry this far below the top will read, 0 disables
+
+    size_t bytes() const { return nodes.size() * sizeof(BVHNode) + prim_ids.size() * sizeof(uint32_t); }
+
+    static const uint32_t max_leaf = 4;
+    static const int max_depth = 64;           // traversal stack size, the builders keep every leaf shallower than this
+    static const uint32_t treelet_size = 4096; // BVH_HYBRID switches to LBVH splits below this
+    static const uint32_t task_size = 8192;    // ranges smaller than this are built serially
+
+    template <typename Prims> void build(const Prims& prims, BVHBuilder builder = BVH_HYBRID) {
+        const long n = long(prims.size());
+        nodes.clear();
+        prim_ids.clear();
+        if (n == 0) return;
+
+        // Compact primitive references: bounds, id and Morton code, permuted in place by the builders
+        const float inf = std::numeric_limits<float>::max();
+        Vec3f cmin(inf, inf, inf), cmax(-inf, -inf, -inf);
+        std::vector<PrimRef> unsorted(n);
+        #pragma omp parallel
+        {
+            Vec3f lo(inf, inf, inf), hi(-inf, -inf, -inf);
+            #pragma omp for nowait
+            for (long i = 0; i < n; i++) {
+                PrimRef& r = unsorted[i];
+                r.bmin = prims[i].bmin;
+                r.bmax = prims[i].bmax;
+                r.id = uint32_t(i);
+                Vec3f c = r.centroid();
+                lo = Vec3f(std::min(lo.x, c.x), std::min(lo.y, c.y), std::min(lo.z, c.z));
+                hi = Vec3f(std::max(hi.x, c.x), std::max(hi.y, c.y), std::max(hi.z, c.z));
+            }
+            #pragma omp critical
+            {
+                cmin = Vec3f(std::min(lo.x, cmin.x), std::min(lo.y, cmin.y), std::min(lo.z, cmin.z));
+                cmax = Vec3f(std::max(hi.x, cmax.x), std::max(hi.y, cmax.y), std::max(hi.z, cmax.z));
+            }
+        }
+
+        if (builder == BVH_SAH) refs.swap(unsorted);
+        else {
+            // Sort (code << 32 | id) keys, ties break on the id so the order is total, then gather the references
+            Vec3f extent = cmax - cmin;
+            Vec3f scale(extent.x > 0 ? 1023.f / extent.x : 0, extent.y > 0 ? 1023.f / extent.y : 0, extent.z > 0 ? 1023.f / extent.z : 0);
+            std::vector<uint64_t> keys(n);
+            #pragma omp parallel for
+            for (long i = 0; i < n; i++) {
+                Vec3f c = unsorted[i].centroid() - cmin;
+                keys[i] = morton3(uint32_t(c.x * scale.x), uint32_t(c.y * scale.y), uint32_t(c.z * scale.z)) << 32 | uint64_t(i);
+            }
+            radix_sort(keys);
+            refs.resize(n);
+            #pragma omp parallel for
+            for (long i = 0; i < n; i++) {
+                refs[i] = unsorted[uint32_t(keys[i])];
+                refs[i].code = uint32_t(keys[i] >> 32);
+            }
+        }
+
+        // Top-down build, children are allocated in pairs from a shared counter
+        nodes.resize(2 * size_t(n));
+        std::atomic<uint32_t> node_count(1);
+        #pragma omp parallel
+        #pragma omp single
+        build_node(builder, node_count, 0, 0, uint32_t(n), 0);
+
+        nodes.resize(node_count);
+        prim_ids.resize(n);
+        #pragma omp parallel for
+        for (long i = 0; i < n; i++) prim_ids[i] = refs[i].id;
+        refs = std::vector<PrimRef>();
+    }
+
+    // Closest hit along the ray: t and primitive index, prim is left at -1 on a miss. The ignore primitive is never tested
+    template <typename Prims> bool intersect(const Vec3f& orig, const Vec3f& dir, const Prims& prims, float& t, int& prim, int ignore = -1) const {
+        t = std::numeric_limits<float>::max();
+        prim = -1;
+        if (nodes.empty()) return false;
+
+        const Vec3f inv_dir(1 / dir.x, 1 / dir.y, 1 / dir.z);
+        uint32_t stack[max_depth];
+        float stack_t[max_depth];
+        int sp = 0;
+        float tnode;
+        if (!box_intersect(nodes[0], orig, inv_dir, t, tnode)) return false;
+        uint32_t n = 0;
+        for (;;) {
+            if (prefetch_distance && sp >= prefetch_distance) {
+                const BVHNode& ahead = nodes[stack[sp - prefetch_distance]];
+                prefetch(ahead.count ? static_cast<const void*>(&prim_ids[ahead.first]) : &nodes[ahead.first]);
+            }
+            const BVHNode& node = nodes[n];
+            if (node.count) {
+                for (uint32_t k = node.first; k < node.first + node.count; k++) {
+                    float tk;
+                    if (int(prim_ids[k]) != ignore && prims[prim_ids[k]].ray_intersect(orig, dir, tk) && tk < t) {
+                        t = tk;
+                        prim = int(prim_ids[k]);
+                    }
+                }
+            }
+            else {
+                float tl, tr;
+                bool hl = box_intersect(nodes[node.first], orig, inv_dir, t, tl);
+                bool hr = box_intersect(nodes[node.first + 1], orig, inv_dir, t, tr);
+                if (hl && hr) { // descend into the nearer child first
+                    bool left_first = tl <= tr;
+                    assert(sp < max_depth);
+                    stack[sp] = left_first ? node.first + 1 : node.first;
+                    stack_t[sp++] = left_first ? tr : tl;
+                    n = left_first ? node.first : node.first + 1;
+                    continue;
+                }
+                if (hl || hr) {
+                    n = hl ? node.first : node.first + 1;
+                    continue;
+                }
+            }
+            // Pop, skipping nodes that are further than the closest hit found since they were pushed
+            do {
+                if (sp == 0) return prim >= 0;
+                n = stack[--sp];
+            } while (stack_t[sp] > t);
+        }
+    }
+
+    static bool box_intersect(const BVHNode& node, const Vec3f& orig, const Vec3f& inv_dir, const float& tmax, float& tnear) {
+        float tx0 = (node.bmin.x - orig.x) * inv_dir.x, tx1 = (node.bmax.x - orig.x) * inv_dir.x;
+        float ty0 = (node.bmin.y - orig.y) * inv_dir.y, ty1 = (node.bmax.y - orig.y) * inv_dir.y;
+        float tz0 = (node.bmin.z - orig.z) * inv_dir.z, tz1 = (node.bmax.z - orig.z) * inv_dir.z;
+        tnear = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), 0.f));
+        float tfar = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::min(std::max(tz0, tz1), tmax));
+        return tnear <= tfar;
+    }
+
+    // Interleave the low 10 bits of x, y and z
+    static uint64_t morton3(uint32_t x, uint32_t y, uint32_t z) {
+        auto spread = [](uint64_t v) {
+            v &= 0x3ff;
+            v = (v | v << 16) & 0x30000ff;
+            v = (v | v << 8) & 0x300f00f;
+            v = (v | v << 4) & 0x30c30c3;
+            v = (v | v << 2) & 0x9249249;
+            return v;
+        };
+        return spread(x) << 2 | spread(y) << 1 | spread(z);
+    }
+
+private:
+    struct PrimRef {
+        Vec3f bmin;
+        uint32_t id;
+        Vec3f bmax;
+        uint32_t code; // Morton code of the centroid, only set by the LBVH and hybrid builders
+        Vec3f centroid() const { return (bmin + bmax) * .5f; }
+    };
+    std::vector<PrimRef> refs; // build temporary
+
+    // Parallel LSD radix sort of the 30 bit Morton codes in the high half of the keys, 8 bits per pass
+    static void radix_sort(std::vector<uint64_t>& keys) {
+        const long n = long(keys.size());
+        const long chunks = 64, chunk = (n + chunks - 1) / chunks;
+        std::vector<uint64_t> tmp(n);
+        std::vector<uint32_t> hist(chunks * 256);
+        for (int shift = 32; shift < 64; shift += 8) {
+            std::fill(hist.begin(), hist.end(), 0);
+            #pragma omp parallel for
+            for (long c = 0; c < chunks; c++)
+                for (long i = c * chunk; i < std::min(n, (c + 1) * chunk); i++) hist[c * 256 + ((keys[i] >> shift) & 255)]++;
+            uint32_t sum = 0; // digit-major prefix keeps each chunk's keys in order, so the sort is stable
+            for (int d = 0; d < 256; d++)
+                for (long c = 0; c < chunks; c++) { uint32_t h = hist[c * 256 + d]; hist[c * 256 + d] = sum; sum += h; }
+            #pragma omp parallel for
+            for (long c = 0; c < chunks; c++)
+                for (long i = c * chunk; i < std::min(n, (c + 1) * chunk); i++) tmp[hist[c * 256 + ((keys[i] >> shift) & 255)]++] = keys[i];
+            keys.swap(tmp);
+        }
+    }
+
+    // Node bounds are merged bottom-up from the children, so only leaves and SAH splits touch primitive bounds.
+    // Unbalanced splits (an outlier peeled off per level, or Morton codes differing in one low bit) can nest deeper
+    // than max_depth, so once median splits from here on would only just fit they are forced
+    void build_node(BVHBuilder builder, std::atomic<uint32_t>& node_count, uint32_t index, uint32_t begin, uint32_t end, int depth) {
+        BVHNode& node = nodes[index];
+        uint32_t count = end - begin;
+        if (count <= max_leaf) {
+            const float inf = std::numeric_limits<float>::max();
+            Vec3f bmin(inf, inf, inf), bmax(-inf, -inf, -inf);
+            for (uint32_t i = begin; i < end; i++) {
+                const PrimRef& r = refs[i];
+                bmin = Vec3f(std::min(bmin.x, r.bmin.x), std::min(bmin.y, r.bmin.y), std::min(bmin.z, r.bmin.z));
+                bmax = Vec3f(std::max(bmax.x, r.bmax.x), std::max(bmax.y, r.bmax.y), std::max(bmax.z, r.bmax.z));
+            }
+            node.bmin = bmin;
+            node.bmax = bmax;
+            node.first = begin;
+            node.count = count;
+            return;
+        }
+
+        uint32_t mid;
+        if (depth + 1 + std::bit_width(count - 1) >= max_depth) mid = begin + count / 2;
+        else if (builder == BVH_SAH || (builder == BVH_HYBRID && count > treelet_size)) mid = split_sah(builder, begin, end);
+        else mid = split_morton(begin, end);
+        if (mid <= begin || mid >= end) mid = begin + count / 2; // degenerate split, e.g. all centroids equal
+
+        uint32_t left = node_count.fetch_add(2);
+        node.first = left;
+        node.count = 0;
+        if (count > task_size) {
+            #pragma omp task shared(node_count)
+            build_node(builder, node_count, left, begin, mid, depth + 1);
+            build_node(builder, node_count, left + 1, mid, end, depth + 1);
+            #pragma omp taskwait
+        }
+        else {
+            build_node(builder, node_count, left, begin, mid, depth + 1);
+            build_node(builder, node_count, left + 1, mid, end, depth + 1);
+        }
+        const BVHNode &l = nodes[left], &r = nodes[left + 1];
+        node.bmin = Vec3f(std::min(l.bmin.x, r.bmin.x), std::min(l.bmin.y, r.bmin.y), std::min(l.bmin.z, r.bmin.z));
+        node.bmax = Vec3f(std::max(l.bmax.x, r.bmax.x), std::max(l.bmax.y, r.bmax.y), std::max(l.bmax.z, r.bmax.z));
+    }
+
+    // First index whose code has the highest bit differing across the (sorted) range set
+    uint32_t split_morton(uint32_t begin, uint32_t end) const {
+        uint32_t first = refs[begin].code, last = refs[end - 1].code;
+        if (first == last) return begin + (end - begin) / 2;
+        uint32_t mask = 1u << 29;
+        while (!((first ^ last) & mask)) mask >>= 1;
+        uint32_t lo = begin, hi = end - 1; // refs[lo] has the bit clear, refs[hi] has it set
+        while (hi - lo > 1) {
+            uint32_t m = lo + (hi - lo) / 2;
+            if (refs[m].code & mask) hi = m;
+            else lo = m;
+        }
+        return hi;
+    }
+
+    // Binned SAH, primitives are binned by centroid and bins grow by primitive bounds. The hybrid builder
+    // partitions stably so that each side stays in Morton order for the LBVH treelets below
+    uint32_t split_sah(BVHBuilder builder, uint32_t begin, uint32_t end) {
+        const int nbins = 16;
+        const float inf = std::numeric_limits<float>::max();
+        Vec3f cmin(inf, inf, inf), cmax(-inf, -inf, -inf);
+        for (uint32_t i = begin; i < end; i++) {
+            Vec3f c = refs[i].centroid();
+            cmin = Vec3f(std::min(cmin.x, c.x), std::min(cmin.y, c.y), std::min(cmin.z, c.z));
+            cmax = Vec3f(std::max(cmax.x, c.x), std::max(cmax.y, c.y), std::max(cmax.z, c.z));
+        }
+        // Bin all three axes in one pass over the range
+        float lo[3], k[3];
+        for (size_t axis = 0; axis < 3; axis++) {
+            float extent = cmax[axis] - cmin[axis];
+            lo[axis] = cmin[axis];
+            k[axis] = extent > 0 ? nbins * (1 - 1e-5f) / extent : 0;
+        }
+        uint32_t count[3][nbins] = {};
+        Vec3f bmin[3][nbins], bmax[3][nbins];
+        for (int axis = 0; axis < 3; axis++)
+            for (int b = 0; b < nbins; b++) { bmin[axis][b] = Vec3f(inf, inf, inf); bmax[axis][b] = Vec3f(-inf, -inf, -inf); }
+        for (uint32_t i = begin; i < end; i++) {
+            const Vec3f &pmin = refs[i].bmin, &pmax = refs[i].bmax;
+            Vec3f c = refs[i].centroid();
+            const int bins[3] = {int((c.x - lo[0]) * k[0]), int((c.y - lo[1]) * k[1]), int((c.z - lo[2]) * k[2])};
+            for (int axis = 0; axis < 3; axis++) {
+                Vec3f &bn = bmin[axis][bins[axis]], &bx = bmax[axis][bins[axis]];
+                count[axis][bins[axis]]++;
+                bn = Vec3f(std::min(bn.x, pmin.x), std::min(bn.y, pmin.y), std::min(bn.z, pmin.z));
+                bx = Vec3f(std::max(bx.x, pmax.x), std::max(bx.y, pmax.y), std::max(bx.z, pmax.z));
+            }
+        }
+
+        float best_cost = inf;
+        int best_axis = -1, best_bin = 0;
+        for (int axis = 0; axis < 3; axis++) {
+            if (k[axis] == 0) continue;
+            // Sweep from the right storing suffix costs, then from the left evaluating every plane
+            float right_cost[nbins];
+            Vec3f rmin(inf, inf, inf), rmax(-inf, -inf, -inf);
+            uint32_t rcount = 0;
+            for (int b = nbins - 1; b > 0; b--) {
+                rmin = Vec3f(std::min(rmin.x, bmin[axis][b].x), std::min(rmin.y, bmin[axis][b].y), std::min(rmin.z, bmin[axis][b].z));
+                rmax = Vec3f(std::max(rmax.x, bmax[axis][b].x), std::max(rmax.y, bmax[axis][b].y), std::max(rmax.z, bmax[axis][b].z));
+                rcount += count[axis][b];
+                right_cost[b] = rcount ? area(rmin, rmax) * rcount : 0;
+            }
+            Vec3f lmin(inf, inf, inf), lmax(-inf, -inf, -inf);
+            uint32_t lcount = 0;
+            for (int b = 0; b < nbins - 1; b++) {
+                lmin = Vec3f(std::min(lmin.x, bmin[axis][b].x), std::min(lmin.y, bmin[axis][b].y), std::min(lmin.z, bmin[axis][b].z));
+                lmax = Vec3f(std::max(lmax.x, bmax[axis][b].x), std::max(lmax.y, bmax[axis][b].y), std::max(lmax.z, bmax[axis][b].z));
+                lcount += count[axis][b];
+                if (lcount == 0 || lcount == end - begin) continue;
+                float cost = area(lmin, lmax) * lcount + right_cost[b + 1];
+                if (cost < best_cost) { best_cost = cost; best_axis = axis; best_bin = b; }
+            }
+        }
+        if (best_axis < 0) return begin + (end - begin) / 2;
+
+        auto left_of = [&](const PrimRef& r) { return int((r.centroid()[best_axis] - lo[best_axis]) * k[best_axis]) <= best_bin; };
+        auto first = refs.begin() + begin, last = refs.begin() + end;
+        return uint32_t((builder == BVH_HYBRID ? std::stable_partition(first, last, left_of) : std::partition(first, last, left_of)) - refs.begin());
+    }
+
+    // Half the surface area, only used to compare costs
+    static float area(const Vec3f& bmin, const Vec3f& bmax) {
+        Vec3f e = bmax - bmin;
+        return e.x * e.y + e.y * e.z + e.z * e.x;
+    }
+};
+
+// Wide BVH collapsed from a binary one: every node tests W children at once (4 lanes per SSE op) and
+// stores child bounds quantized to 8 bits on a power of two grid anchored at the node's origin.
+// A BVH4 node is one 64 byte cache line, a BVH8 node two
+template <int W> struct alignas(64) WideBVHNode {
+    Vec3f origin;           // child bounds are origin + q * 2^exponent per axis
+    int8_t exponent[3];
+    uint8_t child_count;    // lanes in use, the rest are masked out
+    uint8_t qmin[3][W];     // conservative: floor for the lower bound, ceil for the upper one
+    uint8_t qmax[3][W];
+    uint32_t child[W];      // inner: node index, leaf: LEAF_BIT | first prim_ids entry << 3 | primitive count
+};
+
+template <int W> struct WideBVH {
+    HugeVector<WideBVHNode<W>> nodes; // nodes[0] is the root
+    HugeVector<uint32_t> prim_ids;
+    int prefetch_distance = 0;        // as in BVH
+
+    static const uint32_t LEAF_BIT = 0x80000000u;
+
+    void build(const BVH& bvh) {
+        static_assert(BVH::max_leaf < 8, "leaf counts are packed in 3 bits");
+        nodes.clear();
+        prim_ids = bvh.prim_ids;
+        if (bvh.nodes.empty()) return;
+        nodes.emplace_back();
+        if (bvh.nodes[0].count) { // the whole scene fits in a single leaf
+            uint32_t root_child = 0;
+            fill_node(bvh, 0, &root_child, 1);
+            return;
+        }
+        collapse(bvh, 0, 0);
+    }
+
+    size_t bytes() const { return nodes.size() * sizeof(WideBVHNode<W>) + prim_ids.size() * sizeof(uint32_t); }
+
+    // Closest hit along the ray: t and primitive index, prim is left at -1 on a miss. The ignore primitive is never tested
+    template <typename Prims> bool intersect(const Vec3f& orig, const Vec3f& dir, const Prims& prims, float& t, int& prim, int ignore = -1) const {
+        t = std::numeric_limits<float>::max();
+        prim = -1;
+        if (nodes.empty()) return false;
+
+        const float o[3] = {orig.x, orig.y, orig.z}, inv[3] = {1 / dir.x, 1 / dir.y, 1 / dir.z};
+        uint32_t stack[BVH::max_depth * W]; // each level down leaves at most W - 1 siblings behind
+        float stack_t[BVH::max_depth * W];
+        int sp = 0;
+        stack[sp] = 0;
+        stack_t[sp++] = 0;
+        while (sp) {
+            --sp;
+            if (stack_t[sp] > t) continue;
+            if (prefetch_distance && sp >= prefetch_distance) {
+                uint32_t ahead = stack[sp - prefetch_distance];
+                if (ahead & LEAF_BIT) prefetch(&prim_ids[(ahead & ~LEAF_BIT) >> 3]);
+                else for (size_t line = 0; line < sizeof(WideBVHNode<W>); line += 64) prefetch(reinterpret_cast<const char*>(&nodes[ahead]) + line);
+            }
+            uint32_t ref = stack[sp];
+            if (ref & LEAF_BIT) {
+                uint32_t first = (ref & ~LEAF_BIT) >> 3, count = ref & 7;
+                for (uint32_t k = first; k < first + count; k++) {
+                    float tk;
+                    if (int(prim_ids[k]) != ignore && prims[prim_ids[k]].ray_intersect(orig, dir, tk) && tk < t) {
+                        t = tk;
+                        prim = int(prim_ids[k]);
+                    }
+                }
+                continue;
+            }
+
+            const WideBVHNode<W>& node = nodes[ref];
+            float tnear[W];
+            unsigned mask = node_intersect(node, o, inv, t, tnear);
+
+            // Push hit children far to near so the nearest one is popped first
+            int first_sp = sp;
+            for (int c = 0; c < W; c++) {
+                if (!(mask & (1u << c))) continue;
+                assert(sp < BVH::max_depth * W);
+                int k = sp++;
+                while (k > first_sp && stack_t[k - 1] < tnear[c]) { stack[k] = stack[k - 1]; stack_t[k] = stack_t[k - 1]; k--; }
+                stack[k] = node.child[c];
+                stack_t[k] = tnear[c];
+            }
+        }
+        return prim >= 0;
+    }
+
+    // Slab test of all children, returns the hit mask. With t = q * (2^e / d) + (origin - o) / d per axis the
+    // dequantization folds into one multiply-add per bound
+    static unsigned node_intersect(const WideBVHNode<W>& node, const float o[3], const float inv[3], float tmax, float tnear[W]) {
+        float a[3], b[3];
+        const float origin[3] = {node.origin.x, node.origin.y, node.origin.z};
+        for (int axis = 0; axis < 3; axis++) {
+            a[axis] = exp2i(node.exponent[axis]) * inv[axis];
+            b[axis] = (origin[axis] - o[axis]) * inv[axis];
+        }
+        unsigned mask = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+        const __m128i zero = _mm_setzero_si128();
+        for (int g = 0; g < W; g += 4) {
+            __m128 tn = _mm_setzero_ps(), tf = _mm_set1_ps(tmax);
+            for (int axis = 0; axis < 3; axis++) {
+                int32_t lo_bytes, hi_bytes;
+                std::memcpy(&lo_bytes, &node.qmin[axis][g], 4);
+                std::memcpy(&hi_bytes, &node.qmax[axis][g], 4);
+                __m128 qlo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(lo_bytes), zero), zero));
+                __m128 qhi = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(hi_bytes), zero), zero));
+                __m128 va = _mm_set1_ps(a[axis]), vb = _mm_set1_ps(b[axis]);
+                __m128 t0 = _mm_add_ps(_mm_mul_ps(qlo, va), vb), t1 = _mm_add_ps(_mm_mul_ps(qhi, va), vb);
+                tn = _mm_max_ps(tn, _mm_min_ps(t0, t1));
+                tf = _mm_min_ps(tf, _mm_max_ps(t0, t1));
+            }
+            _mm_storeu_ps(tnear + g, tn);
+            mask |= unsigned(_mm_movemask_ps(_mm_cmple_ps(tn, tf))) << g;
+        }
+#else
+        for (int c = 0; c < W; c++) {
+            float tn = 0, tf = tmax;
+            for (int axis = 0; axis < 3; axis++) {
+                float t0 = node.qmin[axis][c] * a[axis] + b[axis], t1 = node.qmax[axis][c] * a[axis] + b[axis];
+                tn = std::max(tn, std::min(t0, t1));
+                tf = std::min(tf, std::max(t0, t1));
+            }
+            tnear[c] = tn;
+            if (tn <= tf) mask |= 1u << c;
+        }
+#endif
+        return mask & ((1u << node.child_count) - 1);
+    }
+
+    // 2^e for e in [-126, 127], straight from the exponent bits
+    static float exp2i(int e) {
+        uint32_t bits = uint32_t(e + 127) << 23;
+        float f;
+        std::memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+
+private:
+    // Gathers up to W binary descendants of a binary node, always opening the largest inner one, then recurses
+    void collapse(const BVH& bvh, uint32_t bin_index, uint32_t wide_index) {
+        uint32_t children[W];
+        int n = 0;
+        children[n++] = bvh.nodes[bin_index].first;
+        children[n++] = bvh.nodes[bin_index].first + 1;
+        while (n < W) {
+            int best = -1;
+            float best_area = -1;
+            for (int c = 0; c < n; c++) {
+                const BVHNode& node = bvh.nodes[children[c]];
+                if (node.count) continue;
+                Vec3f e = node.bmax - node.bmin;
+                float area = e.x * e.y + e.y * e.z + e.z * e.x;
+                if (area > best_area) { best_area = area; best = c; }
+            }
+            if (best < 0) break;
+            uint32_t opened = children[best];
+            children[best] = bvh.nodes[opened].first;
+            children[n++] = bvh.nodes[opened].first + 1;
+        }
+        fill_node(bvh, wide_index, children, n);
+        for (int c = 0; c < n; c++) {
+            if (nodes[wide_index].child[c] & LEAF_BIT) continue;
+            uint32_t child_index = uint32_t(nodes.size());
+            nodes.emplace_back();
+            nodes[wide_index].child[c] = child_index;
+            collapse(bvh, children[c], child_index);
+        }
+    }
+
+    // Quantizes the children bounds against their union, inner children are linked by collapse()
+    void fill_node(const BVH& bvh, uint32_t wide_index, const uint32_t* children, int n) {
+        WideBVHNode<W>& node = nodes[wide_index];
+        const float inf = std::numeric_limits<float>::max();
+        float lo[3] = {inf, inf, inf}, hi[3] = {-inf, -inf, -inf};
+        for (int c = 0; c < n; c++) {
+            const BVHNode& child = bvh.nodes[children[c]];
+            for (int axis = 0; axis < 3; axis++) {
+                lo[axis] = std::min(lo[axis], child.bmin[axis]);
+                hi[axis] = std::max(hi[axis], child.bmax[axis]);
+            }
+        }
+        node.origin = Vec3f(lo[0], lo[1], lo[2]);
+        node.child_count = uint8_t(n);
+        for (int axis = 0; axis < 3; axis++) {
+            // Smallest power of two step that spans the extent in 255 steps
+            int e;
+            std::frexp((hi[axis] - lo[axis]) / 255.f, &e);
+            node.exponent[axis] = int8_t(std::max(-126, std::min(127, e)));
+        }
+        for (int c = 0; c < W; c++) {
+            for (int axis = 0; axis < 3; axis++) { node.qmin[axis][c] = 255; node.qmax[axis][c] = 0; }
+            node.child[c] = 0;
+            if (c >= n) continue;
+            const BVHNode& child = bvh.nodes[children[c]];
+            for (int axis = 0; axis < 3; axis++) {
+                float inv_scale = exp2i(-node.exponent[axis]);
+                float qlo = std::floor((child.bmin[axis] - lo[axis]) * inv_scale), qhi = std::ceil((child.bmax[axis] - lo[axis]) * inv_scale);
+                node.qmin[axis][c] = uint8_t(std::max(0.f, std::min(255.f, qlo)));
+                node.qmax[axis][c] = uint8_t(std::max(0.f, std::min(255.f, qhi)));
+            }
+            node.child[c] = child.count ? LEAF_BIT | child.first << 3 | child.count : 0;
+        }
+    }
+};
+
+#endif //__BVH_H__
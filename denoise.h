@@ -0,0 +1,178 @@
+#ifndef __DENOISE_H__
+#define __DENOISE_H__
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cstddef>
+#include "geometry.h"
+#include "gbuffer.h"
+
+// The row loops are compiled for AVX2 as well as the baseline, and the loader picks by CPU. FMA stays off: fusing
+// the multiplies would round differently, and the filtered image would then depend on the machine
+#if defined(__GNUC__) && defined(__x86_64__)
+#define TINYRT_DENOISE_DISPATCH __attribute__((target_clones("avx2", "default")))
+#else
+#define TINYRT_DENOISE_DISPATCH
+#endif
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al., "Edge-Avoiding A-Trous Wavelet Transform for fast Global
+// Illumination Filtering"): iterations of a 3x3 B-spline kernel whose taps are 2^i pixels apart, every tap weighted
+// down by how much its color, normal and depth differ from the center's, so the footprint keeps growing over smooth
+// regions and stops at edges. Colors are divided by the albedo first so only the lighting is smoothed, not textures.
+// Channels are kept in planes and filtered a row at a time, which lets the tap loop vectorize; rows run in parallel.
+// The normal weight of a pair of pixels is the same from either side, so each iteration computes it once per pair,
+// for the four tap offsets pointing right or down, and the taps in the opposite direction read their neighbour's
+struct Denoiser {
+    int iterations = 4;        // the footprint is 2^(iterations + 1) - 1 pixels wide
+    float sigma_color = .5f;   // relative color difference tolerated, halved every iteration as the noise goes down
+    float sigma_depth = .05f;  // relative depth difference tolerated per pixel of tap distance
+
+    // Filters the w x h pixels of image, rows stride apart, guided by gbuffer with the same layout
+    void apply(Vec3f* image, const GBuffer& gbuffer, int w, int h, size_t stride) {
+        const size_t pixels = stride * h;
+        for (int c = 0; c < 3; c++) for (int k = 0; k < 2; k++) color[k][c].resize(pixels);
+        depth.resize(pixels);
+        depth_scale.resize(pixels);
+        for (int k = 0; k < 4; k++) normal_weight[k].resize(pixels);
+
+        // Demodulate: lighting only, where the albedo allows it. Misses get no depth and no normal, so nothing
+        // is mixed into or out of them
+        const float* albedo[3] = {gbuffer.ar.data(), gbuffer.ag.data(), gbuffer.ab.data()};
+        #pragma omp parallel for schedule(static)
+        for (int y = 0; y < h; y++) {
+            for (size_t p = y * stride; p < y * stride + w; p++) {
+                for (int c = 0; c < 3; c++) color[0][c][p] = image[p][c] / demodulation(albedo[c][p]);
+                const bool hit = gbuffer.depth[p] < std::numeric_limits<float>::infinity();
+                depth[p] = hit ? gbuffer.depth[p] : 0.f;
+                depth_scale[p] = hit ? 1 / (sigma_depth * gbuffer.depth[p]) : 0.f;
+            }
+        }
+
+        int in = 0;
+        for (int i = 0; i < iterations; i++, in ^= 1) {
+            const int step = 1 << i;
+            const float sigma = sigma_color / step;
+            const Pass pass = {color[in][0].data(), color[in][1].data(), color[in][2].data(),
+                               color[in ^ 1][0].data(), color[in ^ 1][1].data(), color[in ^ 1][2].data(),
+                               gbuffer.nx.data(), gbuffer.ny.data(), gbuffer.nz.data(),
+                               {normal_weight[0].data(), normal_weight[1].data(), normal_weight[2].data(), normal_weight[3].data()},
+                               depth.data(), depth_scale.data(), w, h, step, ptrdiff_t(stride), 1 / (sigma * sigma), 1.f / step};
+            #pragma omp parallel for schedule(static)
+            for (int y = 0; y < h; y++) weigh_row(pass, y);
+            #pragma omp parallel for schedule(static)
+            for (int y = 0; y < h; y++) filter_row(pass, y);
+        }
+
+        #pragma omp parallel for schedule(static)
+        for (int y = 0; y < h; y++) {
+            for (size_t p = y * stride; p < y * stride + w; p++) {
+                image[p] = Vec3f(color[in][0][p] * demodulation(gbuffer.ar[p]),
+                                 color[in][1][p] * demodulation(gbuffer.ag[p]),
+                                 color[in][2][p] * demodulation(gbuffer.ab[p]));
+            }
+        }
+    }
+
+private:
+    std::vector<float> color[2][3];          // ping-pong planes of the demodulated color
+    std::vector<float> depth, depth_scale;   // primary hit distance (0 on a miss), and 1 / (sigma_depth * depth)
+    std::vector<float> normal_weight[4];     // (N.Nq)^32 between a pixel and its tap at +taps[k], 0 past the border
+
+    // Tap directions in units of the iteration's step; the last four are the first four reversed
+    static constexpr int taps[8][2] = {{1, 0}, {0, 1}, {1, 1}, {-1, 1}, {-1, 0}, {0, -1}, {-1, -1}, {1, -1}};
+
+    struct Pass {
+        const float *r, *g, *b;
+        float *out_r, *out_g, *out_b;
+        const float *nx, *ny, *nz;
+        float* normal_weight[4];
+        const float *depth, *depth_scale;
+        int w, h, step;
+        ptrdiff_t stride;
+        float color_scale; // 1 / sigma^2 of this iteration
+        float inv_step;
+    };
+
+    // What the color of a pixel is divided by, dark albedos are left alone rather than amplifying their noise
+    static float demodulation(float albedo) { return albedo > .01f ? albedo : 1.f; }
+
+    // max(0, x) without a branch the compiler could thread the following multiplies behind, which keeps the
+    // tap loop if-convertible and so vectorizable
+    static float positive(float x) { return .5f * (x + std::fabs(x)); }
+
+    // exp(-x) for x >= 0 as (1 - x/8)^8: cheap, branch free and exactly 0 past x = 8
+    static float falloff(float x) {
+        float f = positive(1.f - x * .125f);
+        f *= f;
+        f *= f;
+        return f * f;
+    }
+
+    // The normal weights of row y for this iteration's step
+    TINYRT_DENOISE_DISPATCH static void weigh_row(const Pass& s, int y) {
+        const size_t row = y * s.stride;
+        for (int k = 0; k < 4; k++) {
+            const int dx = taps[k][0] * s.step, dy = taps[k][1] * s.step;
+            const ptrdiff_t offset = dy * s.stride + dx;
+            const int x0 = std::min(s.w, std::max(0, -dx)), x1 = y + dy < s.h ? std::max(x0, s.w - std::max(0, dx)) : x0;
+            const float *nx = s.nx + row, *ny = s.ny + row, *nz = s.nz + row;
+            float* out = s.normal_weight[k] + row;
+            for (int x = 0; x < x0; x++) out[x] = 0;
+            #pragma omp simd
+            for (int x = x0; x < x1; x++) {
+                float n = positive(nx[x] * nx[x + offset] + ny[x] * ny[x + offset] + nz[x] * nz[x + offset]);
+                n *= n; n *= n; n *= n; n *= n; n *= n; // (N.Nq)^32
+                out[x] = n;
+            }
+            for (int x = x1; x < s.w; x++) out[x] = 0;
+        }
+    }
+
+    // Filters row y, the taps that could fall outside the image separately so the rest vectorizes
+    TINYRT_DENOISE_DISPATCH static void filter_row(const Pass& s, int y) {
+        const size_t row = y * s.stride;
+        if (y < s.step || y >= s.h - s.step) {
+            for (int x = 0; x < s.w; x++) filter<true>(s, row + x, x, y);
+            return;
+        }
+        const int x0 = std::min(s.step, s.w), x1 = std::max(x0, s.w - s.step);
+        for (int x = 0; x < x0; x++) filter<true>(s, row + x, x, y);
+        #pragma omp simd
+        for (int x = x0; x < x1; x++) filter<false>(s, row + x, x, y);
+        for (int x = x1; x < s.w; x++) filter<true>(s, row + x, x, y);
+    }
+
+    // One output pixel; Border checks the taps against the image bounds, the interior loop leaves that out. The tap
+    // loop is unrolled up front and the whole function inlined into both clones of filter_row(), so the loop over
+    // pixels has no inner loop or call left to keep it from vectorizing
+    template <bool Border> [[gnu::always_inline]] static void filter(const Pass& s, size_t p, int x, int y) {
+        const float r = s.r[p], g = s.g[p], b = s.b[p];
+        const float z = s.depth[p], zs = s.depth_scale[p] * s.inv_step;
+        const float cs = s.color_scale / (r * r + g * g + b * b + .01f); // differences relative to the center's brightness
+        float sum_r = r * .25f, sum_g = g * .25f, sum_b = b * .25f, sum_w = .25f; // the center always counts fully
+        #pragma GCC unroll 8
+        for (int k = 0; k < 8; k++) {
+            const int dx = taps[k][0], dy = taps[k][1];
+            if (Border) {
+                int qx = x + dx * s.step, qy = y + dy * s.step;
+                if (qx < 0 || qx >= s.w || qy < 0 || qy >= s.h) continue;
+            }
+            const size_t q = p + (dy * s.stride + dx) * s.step;
+            const float kernel = dx && dy ? 1.f / 16 : 1.f / 8;
+            const float n = k < 4 ? s.normal_weight[k][p] : s.normal_weight[k - 4][q];
+            const float cr = s.r[q] - r, cg = s.g[q] - g, cb = s.b[q] - b;
+            const float e = (cr * cr + cg * cg + cb * cb) * cs + std::fabs(s.depth[q] - z) * zs;
+            const float weight = kernel * n * falloff(e);
+            sum_r += weight * s.r[q];
+            sum_g += weight * s.g[q];
+            sum_b += weight * s.b[q];
+            sum_w += weight;
+        }
+        const float inv = 1 / sum_w;
+        s.out_r[p] = sum_r * inv;
+        s.out_g[p] = sum_g * inv;
+        s.out_b[p] = sum_b * inv;
+    }
+};
+
+#endif //__DENOISE_H__
@@ -0,0 +1,129 @@
+#ifndef __GBUFFER_H__
+#define __GBUFFER_H__
+#include <vector>
+#include <limits>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include "geometry.h"
+
+// What the primary ray of a pixel found, reported by the trace kernels when asked for it
+struct PrimaryHit {
+    float depth = std::numeric_limits<float>::infinity(); // distance along the ray, infinite on a miss
+    Vec3f N;                                                // shading normal, zero on a miss
+    Vec3f albedo;                                           // diffuse color at the hit
+    int32_t id = -1;                                        // primitive hit, -1 on a miss; materials belong to primitives
+};
+
+// Channels of the G-buffer that can be shown in place of the image
+enum GBufferView { GBUFFER_COLOR, GBUFFER_DEPTH, GBUFFER_NORMAL, GBUFFER_ID, GBUFFER_ALBEDO, GBUFFER_VIEW_COUNT };
+const char* const gbuffer_view_names[GBUFFER_VIEW_COUNT] = {"color", "depth", "normal", "id", "albedo"};
+
+// Allocator starting arrays on a cache line, so tiles 16 pixels wide store whole lines of a float plane
+template <typename T> struct CacheLineAllocator {
+    typedef T value_type;
+    static const size_t alignment = 64;
+
+    CacheLineAllocator() = default;
+    template <typename U> CacheLineAllocator(const CacheLineAllocator<U>&) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignment))); }
+    void deallocate(T* p, size_t) { ::operator delete(p, std::align_val_t(alignment)); }
+
+    template <typename U> bool operator==(const CacheLineAllocator<U>&) const { return true; }
+    template <typename U> bool operator!=(const CacheLineAllocator<U>&) const { return false; }
+};
+
+template <typename T> using Plane = std::vector<T, CacheLineAllocator<T>>;
+
+// Per pixel data of the primary hits, one plane per channel laid out like the framebuffer (rows width apart),
+// so filters can stream through a channel at a time. Filled during the trace itself: a kernel already has all of
+// it at hand when it shades the hit, so recording it costs a few stores per pixel
+struct GBuffer {
+    Plane<float> depth;
+    Plane<float> nx, ny, nz;
+    Plane<float> ar, ag, ab; // albedo
+    Plane<int32_t> id;
+
+    void resize(size_t pixels) {
+        for (Plane<float>* plane : {&depth, &nx, &ny, &nz, &ar, &ag, &ab}) plane->assign(pixels, 0.f);
+        id.assign(pixels, -1);
+    }
+
+    size_t size() const { return depth.size(); }
+
+    void write(size_t pixel, const PrimaryHit& hit) {
+        depth[pixel] = hit.depth;
+        nx[pixel] = hit.N.x;
+        ny[pixel] = hit.N.y;
+        nz[pixel] = hit.N.z;
+        ar[pixel] = hit.albedo.x;
+        ag[pixel] = hit.albedo.y;
+        ab[pixel] = hit.albedo.z;
+        id[pixel] = hit.id;
+    }
+
+    // Stores a w x h block of hits, rows stride apart from pixel first on, a plane at a time with streaming stores.
+    // Tiles are written in an order the hardware prefetchers can't follow, so plain stores would mostly wait for
+    // the line to be read first; streamed whole lines skip that read, and the frame is done with them anyway.
+    // A thread calls fence() once it's done writing
+    void write(size_t first, int w, int h, size_t stride, const PrimaryHit* hits) {
+        store(depth, first, w, h, stride, hits, [](const PrimaryHit& hit) { return hit.depth; });
+        store(nx, first, w, h, stride, hits, [](const PrimaryHit& hit) { return hit.N.x; });
+        store(ny, first, w, h, stride, hits, [](const PrimaryHit& hit) { return hit.N.y; });
+        store(nz, first, w, h, stride, hits, [](const PrimaryHit& hit) { return hit.N.z; });
+        store(ar, first, w, h, stride, hits, [](const PrimaryHit& hit) { return hit.albedo.x; });
+        store(ag, first, w, h, stride, hits, [](const PrimaryHit& hit) { return hit.albedo.y; });
+        store(ab, first, w, h, stride, hits, [](const PrimaryHit& hit) { return hit.albedo.z; });
+        store(id, first, w, h, stride, hits, [](const PrimaryHit& hit) { return hit.id; });
+    }
+
+    // Streaming stores are weakly ordered, this makes the calling thread's visible before others read the planes
+    static void fence() {
+#if defined(__SSE__) || defined(_M_X64)
+        _mm_sfence();
+#endif
+    }
+
+    // Replaces the w x h pixels of image, rows stride apart, with a false color picture of one channel: depth as
+    // gray falling off with distance, normals mapped to [0, 1], ids hashed to colors, misses black
+    void show(GBufferView view, Vec3f* image, int w, int h, size_t stride) const {
+        #pragma omp parallel for schedule(static)
+        for (int y = 0; y < h; y++) {
+            for (size_t p = y * stride; p < y * stride + w; p++) {
+                const bool hit = id[p] != -1;
+                switch (view) {
+                    case GBUFFER_DEPTH: image[p] = Vec3f(1, 1, 1) * (hit ? 10 / (10 + depth[p]) : 0.f); break;
+                    case GBUFFER_NORMAL: image[p] = hit ? Vec3f(nx[p] + 1, ny[p] + 1, nz[p] + 1) * .5f : Vec3f(0, 0, 0); break;
+                    case GBUFFER_ID: {
+                        uint32_t k = (uint32_t(id[p]) ^ 0x5bd1e995u) * 2654435761u; // Knuth's multiplicative hash spreads neighboring ids
+                        image[p] = hit ? Vec3f(k >> 24, (k >> 16) & 255, (k >> 8) & 255) * (1.f / 255) : Vec3f(0, 0, 0);
+                        break;
+                    }
+                    case GBUFFER_ALBEDO: image[p] = Vec3f(ar[p], ag[p], ab[p]); break;
+                    default: break;
+                }
+            }
+        }
+    }
+
+private:
+    template <typename T, typename Channel> static void store(Plane<T>& plane, size_t first, int w, int h, size_t stride, const PrimaryHit* hits, Channel channel) {
+        static_assert(sizeof(T) == sizeof(float), "planes are streamed as floats");
+        for (int y = 0; y < h; y++) {
+            T* row = plane.data() + first + y * stride;
+            const PrimaryHit* in = hits + y * w;
+            int x = 0;
+#if defined(__SSE__) || defined(_M_X64)
+            for (; x < w && uintptr_t(row + x) % 16; x++) row[x] = channel(in[x]);
+            for (; x + 4 <= w; x += 4) {
+                alignas(16) T v[4] = {channel(in[x]), channel(in[x + 1]), channel(in[x + 2]), channel(in[x + 3])};
+                _mm_stream_ps(reinterpret_cast<float*>(row + x), _mm_load_ps(reinterpret_cast<const float*>(v)));
+            }
+#endif
+            for (; x < w; x++) row[x] = channel(in[x]);
+        }
+    }
+};
+
+#endif //__GBUFFER_H__
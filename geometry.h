@@ -1,9 +1,85 @@
 #ifndef __GEOMETRY_H__
 #define __GEOMETRY_H__
 #include <cmath>
+#include <algorithm>
 #include <vector>
 #include <cassert>
 #include <iostream>
+#include <cstdint>
+#include <cstring>
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#endif
+
+// Approximate math for the shading hot path, selected at build time with TINYRT_FAST_MATH
+
+// 1/sqrt(x): hardware estimate (or the bit trick) refined with Newton steps, relative error below 1e-6
+inline float fast_rsqrt(float x) {
+#if defined(__SSE__) || defined(_M_X64)
+    float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+#else
+    uint32_t i;
+    std::memcpy(&i, &x, sizeof(i));
+    i = 0x5f375a86 - (i >> 1);
+    float y;
+    std::memcpy(&y, &i, sizeof(y));
+    y = y * (1.5f - 0.5f * x * y * y);
+#endif
+    return y * (1.5f - 0.5f * x * y * y);
+}
+
+// log2(x) for normal x > 0 from the atanh series of the mantissa, absolute error below 1e-6 plus the rounding of
+// the result to float (|log2(x)| * 2^-24)
+inline float fast_log2(float x) {
+    // x = 2^e * m with m in [sqrt(1/2), sqrt(2)), centered on 1 so the series converges fast. Found with integer
+    // ops only, a compare on the mantissa would be a branch that random inputs mispredict half the time
+    const uint32_t sqrt_half = 0x3f3504f3;
+    uint32_t i;
+    std::memcpy(&i, &x, sizeof(i));
+    i -= sqrt_half;
+    const float e = float(int32_t(i) >> 23);
+    i = (i & 0x007fffff) + sqrt_half;
+    float m;
+    std::memcpy(&m, &i, sizeof(m));
+    float t = (m - 1) / (m + 1), t2 = t * t;
+    return e + 2.8853900818f * t * (1.f + t2 * (1.f / 3 + t2 * (1.f / 5 + t2 * (1.f / 7))));
+}
+
+// 2^x from a degree 5 polynomial on the rounded fraction, relative error below 1e-5, flushes to 0 below 2^-126
+inline float fast_exp2(float x) {
+    if (x < -126.f) return 0.f;
+    if (x > 127.f) x = 127.f;
+    const int n = int(x + std::copysign(.5f, x)); // rounded by conversion, std::nearbyint() is a call into libm before SSE4.1
+    float f = (x - float(n)) * 0.6931471806f;
+    uint32_t i = uint32_t(n + 127) << 23;
+    float p;
+    std::memcpy(&p, &i, sizeof(p));
+    return p * (1.f + f * (1.f + f * (1.f / 2 + f * (1.f / 6 + f * (1.f / 24 + f * (1.f / 120))))));
+}
+
+// x^e for x in [0, 1] as used by the specular term, relative error below 2e-5 for e up to 1425; results below
+// 2^-126 flush to 0
+inline float fast_pow(float x, float e) {
+    if (x <= 0.f) return e == 0.f ? 1.f : 0.f;
+    return fast_exp2(e * fast_log2(x));
+}
+
+// atan2(y, x) from a degree 11 odd polynomial on the octant, absolute error below 1e-5 radians
+inline float fast_atan2(float y, float x) {
+    float ax = std::fabs(x), ay = std::fabs(y);
+    float a = std::min(ax, ay) / std::max(std::max(ax, ay), 1e-30f), s = a * a;
+    float r = a * (0.99997726f + s * (-0.33262347f + s * (0.19354346f + s * (-0.11643287f + s * (0.05265332f + s * -0.01172120f)))));
+    if (ay > ax) r = 1.57079637f - r;
+    if (x < 0) r = 3.14159274f - r;
+    return y < 0 ? -r : r;
+}
+
+// acos(x) for x in [-1, 1] (Abramowitz and Stegun 4.4.45 with a square root), absolute error below 1e-4 radians
+inline float fast_acos(float x) {
+    float ax = std::min(std::fabs(x), 1.f);
+    float r = std::sqrt(1 - ax) * (1.5707288f + ax * (-0.2121144f + ax * (0.0742610f + ax * -0.0187293f)));
+    return x < 0 ? 3.14159274f - r : r;
+}
 
 template <size_t DIM, typename T> struct vec {
     vec() { for (size_t i=DIM; i--; data_[i] = T()); }
@@ -19,27 +95,32 @@ typedef vec<3, int  > Vec3i;
 typedef vec<4, float> Vec4f;
 
 template <typename T> struct vec<2,T> {
-    vec() : x(T()), y(T()) {}
-    vec(T X, T Y) : x(X), y(Y) {}
-    template <class U> vec<2,T>(const vec<2,U> &v);
+    constexpr vec() : x(T()), y(T()) {}
+    constexpr vec(T X, T Y) : x(X), y(Y) {}
+    template <class U> vec(const vec<2,U> &v);
           T& operator[](const size_t i)       { assert(i<2); return i<=0 ? x : y; }
     const T& operator[](const size_t i) const { assert(i<2); return i<=0 ? x : y; }
     T x,y;
 };
 
 template <typename T> struct vec<3,T> {
-    vec() : x(T()), y(T()), z(T()) {}
-    vec(T X, T Y, T Z) : x(X), y(Y), z(Z) {}
+    constexpr vec() : x(T()), y(T()), z(T()) {}
+    constexpr vec(T X, T Y, T Z) : x(X), y(Y), z(Z) {}
           T& operator[](const size_t i)       { assert(i<3); return i<=0 ? x : (1==i ? y : z); }
     const T& operator[](const size_t i) const { assert(i<3); return i<=0 ? x : (1==i ? y : z); }
+#ifdef TINYRT_FAST_MATH
+    float norm() { float n2 = x*x+y*y+z*z; return n2 > 0 ? n2*fast_rsqrt(n2) : 0; }
+    vec<3,T> & normalize(T l=1) { *this = (*this)*(l*fast_rsqrt(x*x+y*y+z*z)); return *this; }
+#else
     float norm() { return std::sqrt(x*x+y*y+z*z); }
     vec<3,T> & normalize(T l=1) { *this = (*this)*(l/norm()); return *this; }
+#endif
     T x,y,z;
 };
 
 template <typename T> struct vec<4,T> {
-    vec() : x(T()), y(T()), z(T()), w(T()) {}
-    vec(T X, T Y, T Z, T W) : x(X), y(Y), z(Z), w(W) {}
+    constexpr vec() : x(T()), y(T()), z(T()), w(T()) {}
+    constexpr vec(T X, T Y, T Z, T W) : x(X), y(Y), z(Z), w(W) {}
           T& operator[](const size_t i)       { assert(i<4); return i<=0 ? x : (1==i ? y : (2==i ? z : w)); }
     const T& operator[](const size_t i) const { assert(i<4); return i<=0 ? x : (1==i ? y : (2==i ? z : w)); }
     T x,y,z,w;
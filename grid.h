@@ -0,0 +1,169 @@
+#ifndef __GRID_H__
+#define __GRID_H__
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cstdint>
+#include "geometry.h"
+#include "hugepage.h"
+
+// Uniform grid for dense fields of similar sized primitives, traversed with a 3D-DDA (Amanatides & Woo).
+// Primitives are anything with bmin/bmax bounds and ray_intersect(orig, dir, t)
+struct UniformGrid {
+    Vec3f bmin, bmax;                 // grid bounds
+    Vec3f cell_size, inv_cell_size;
+    int res[3] = {0, 0, 0};           // cells per axis
+    HugeVector<uint32_t> cell_start; // res[0] * res[1] * res[2] + 1 offsets into prim_ids
+    HugeVector<uint32_t> prim_ids;   // primitive references, grouped per cell
+
+    // density is the target number of cells per primitive
+    template <typename Prims> void build(const Prims& prims, float density = 2.f) {
+        const long n = long(prims.size());
+        cell_start.clear();
+        prim_ids.clear();
+        if (n == 0) return;
+
+        // Scene bounds
+        const float inf = std::numeric_limits<float>::max();
+        bmin = Vec3f(inf, inf, inf);
+        bmax = Vec3f(-inf, -inf, -inf);
+        #pragma omp parallel
+        {
+            Vec3f lo(inf, inf, inf), hi(-inf, -inf, -inf);
+            #pragma omp for nowait
+            for (long i = 0; i < n; i++) {
+                lo = Vec3f(std::min(lo.x, prims[i].bmin.x), std::min(lo.y, prims[i].bmin.y), std::min(lo.z, prims[i].bmin.z));
+                hi = Vec3f(std::max(hi.x, prims[i].bmax.x), std::max(hi.y, prims[i].bmax.y), std::max(hi.z, prims[i].bmax.z));
+            }
+            #pragma omp critical
+            {
+                bmin = Vec3f(std::min(lo.x, bmin.x), std::min(lo.y, bmin.y), std::min(lo.z, bmin.z));
+                bmax = Vec3f(std::max(hi.x, bmax.x), std::max(hi.y, bmax.y), std::max(hi.z, bmax.z));
+            }
+        }
+
+        // Resolution: cubic-ish cells, about density cells per primitive
+        Vec3f extent = bmax - bmin;
+        for (size_t a = 0; a < 3; a++) extent[a] = std::max(extent[a], 1e-4f);
+        float k = std::cbrt(density * n / (extent.x * extent.y * extent.z));
+        for (size_t a = 0; a < 3; a++) {
+            res[a] = std::max(1, std::min(1024, int(extent[a] * k)));
+            cell_size[a] = extent[a] / res[a];
+            inv_cell_size[a] = 1 / cell_size[a];
+        }
+        const size_t ncells = size_t(res[0]) * res[1] * res[2];
+
+        // Count references per cell, exclusive prefix sum, then scatter
+        std::vector<uint32_t> counts(ncells + 1, 0);
+        #pragma omp parallel for
+        for (long i = 0; i < n; i++) {
+            int lo[3], hi[3];
+            cell_range(prims[i], lo, hi);
+            for (int z = lo[2]; z <= hi[2]; z++) for (int y = lo[1]; y <= hi[1]; y++) for (int x = lo[0]; x <= hi[0]; x++) {
+                #pragma omp atomic
+                counts[cell_index(x, y, z)]++;
+            }
+        }
+        cell_start.resize(ncells + 1);
+        uint32_t sum = 0;
+        for (size_t c = 0; c <= ncells; c++) { cell_start[c] = sum; sum += counts[c]; }
+        prim_ids.resize(sum);
+
+        std::vector<uint32_t>& cursor = counts;
+        std::copy(cell_start.begin(), cell_start.end(), cursor.begin());
+        #pragma omp parallel for
+        for (long i = 0; i < n; i++) {
+            int lo[3], hi[3];
+            cell_range(prims[i], lo, hi);
+            for (int z = lo[2]; z <= hi[2]; z++) for (int y = lo[1]; y <= hi[1]; y++) for (int x = lo[0]; x <= hi[0]; x++) {
+                uint32_t pos;
+                #pragma omp atomic capture
+                pos = cursor[cell_index(x, y, z)]++;
+                prim_ids[pos] = uint32_t(i);
+            }
+        }
+
+        // Scatter order depends on thread timing, sort so traversal (and ties) are deterministic
+        #pragma omp parallel for schedule(dynamic, 1024)
+        for (long c = 0; c < long(ncells); c++) std::sort(prim_ids.begin() + cell_start[c], prim_ids.begin() + cell_start[c + 1]);
+    }
+
+    // Closest hit along the ray: t and primitive index, prim is left at -1 on a miss. The ignore primitive is never tested
+    template <typename Prims> bool intersect(const Vec3f& orig, const Vec3f& dir, const Prims& prims, float& t, int& prim, int ignore = -1) const {
+        t = std::numeric_limits<float>::max();
+        prim = -1;
+        if (prim_ids.empty()) return false;
+
+        const float o[3] = {orig.x, orig.y, orig.z}, d[3] = {dir.x, dir.y, dir.z};
+        const float lo[3] = {bmin.x, bmin.y, bmin.z}, hi[3] = {bmax.x, bmax.y, bmax.z};
+        const float cs[3] = {cell_size.x, cell_size.y, cell_size.z}, ics[3] = {inv_cell_size.x, inv_cell_size.y, inv_cell_size.z};
+
+        // Clip the ray against the grid bounds
+        float t0 = 0, t1 = t;
+        for (int a = 0; a < 3; a++) {
+            if (d[a] == 0) {
+                if (o[a] < lo[a] || o[a] > hi[a]) return false;
+                continue;
+            }
+            float inv = 1 / d[a];
+            float tn = (lo[a] - o[a]) * inv, tf = (hi[a] - o[a]) * inv;
+            if (tn > tf) std::swap(tn, tf);
+            t0 = std::max(t0, tn);
+            t1 = std::min(t1, tf);
+        }
+        if (t0 > t1) return false;
+
+        // DDA setup
+        int c[3], step[3];
+        float next_t[3], delta_t[3];
+        for (int a = 0; a < 3; a++) {
+            c[a] = std::max(0, std::min(res[a] - 1, int((o[a] + d[a] * t0 - lo[a]) * ics[a])));
+            if (d[a] > 0) {
+                step[a] = 1;
+                next_t[a] = (lo[a] + (c[a] + 1) * cs[a] - o[a]) / d[a];
+                delta_t[a] = cs[a] / d[a];
+            }
+            else if (d[a] < 0) {
+                step[a] = -1;
+                next_t[a] = (lo[a] + c[a] * cs[a] - o[a]) / d[a];
+                delta_t[a] = -cs[a] / d[a];
+            }
+            else {
+                step[a] = 0;
+                next_t[a] = delta_t[a] = std::numeric_limits<float>::max();
+            }
+        }
+
+        for (;;) {
+            size_t cell = cell_index(c[0], c[1], c[2]);
+            for (uint32_t k = cell_start[cell]; k < cell_start[cell + 1]; k++) {
+                float tk;
+                uint32_t id = prim_ids[k];
+                if (int(id) != ignore && prims[id].ray_intersect(orig, dir, tk) && tk < t) {
+                    t = tk;
+                    prim = int(id);
+                }
+            }
+            // A hit inside the current cell can't be beaten by anything further along the ray
+            int a = next_t[0] < next_t[1] ? (next_t[0] < next_t[2] ? 0 : 2) : (next_t[1] < next_t[2] ? 1 : 2);
+            if (t <= next_t[a] || next_t[a] > t1) break;
+            c[a] += step[a];
+            if (c[a] < 0 || c[a] >= res[a]) break;
+            next_t[a] += delta_t[a];
+        }
+        return prim >= 0;
+    }
+
+    size_t cell_index(int x, int y, int z) const { return size_t(x) + size_t(res[0]) * (size_t(y) + size_t(res[1]) * size_t(z)); }
+
+    template <typename Prim> void cell_range(const Prim& p, int lo[3], int hi[3]) const {
+        const float pmin[3] = {p.bmin.x, p.bmin.y, p.bmin.z}, pmax[3] = {p.bmax.x, p.bmax.y, p.bmax.z};
+        const float gmin[3] = {bmin.x, bmin.y, bmin.z}, ics[3] = {inv_cell_size.x, inv_cell_size.y, inv_cell_size.z};
+        for (int a = 0; a < 3; a++) {
+            lo[a] = std::max(0, std::min(res[a] - 1, int((pmin[a] - gmin[a]) * ics[a])));
+            hi[a] = std::max(0, std::min(res[a] - 1, int((pmax[a] - gmin[a]) * ics[a])));
+        }
+    }
+};
+
+#endif //__GRID_H__
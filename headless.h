@@ -0,0 +1,37 @@
+#ifndef __HEADLESS_H__
+#define __HEADLESS_H__
+
+// Stand-in for the part of raylib the renderer uses, for TINYRT_HEADLESS builds: there is no window, nothing is
+// drawn and no key is ever pressed, so runs are driven by the command line (--frames, --scale, ...). The benchmarks
+// and regression tests run on it, they need neither a display nor raylib
+struct Color { unsigned char r, g, b, a; };
+struct Image { void* data; int width, height, mipmaps, format; };
+struct Texture2D { unsigned int id; int width, height, mipmaps, format; };
+
+enum { FLAG_VSYNC_HINT = 0x00000040 };
+enum { PIXELFORMAT_UNCOMPRESSED_R8G8B8A8 = 7 };
+enum KeyboardKey {
+    KEY_A = 65, KEY_B = 66, KEY_C = 67, KEY_D = 68, KEY_G = 71, KEY_I = 73, KEY_L = 76, KEY_S = 83, KEY_U = 85,
+    KEY_RIGHT = 262, KEY_LEFT = 263, KEY_DOWN = 264, KEY_UP = 265
+};
+
+#define DEG2RAD (3.14159265358979323846f / 180.0f)
+constexpr Color WHITE = {255, 255, 255, 255};
+constexpr Color BLACK = {0, 0, 0, 255};
+
+inline void SetConfigFlags(unsigned int) {}
+inline void InitWindow(int, int, const char*) {}
+inline bool WindowShouldClose() { return false; }
+inline void CloseWindow() {}
+inline void SetTargetFPS(int) {}
+inline bool IsKeyPressed(int) { return false; }
+inline void BeginDrawing() {}
+inline void EndDrawing() {}
+inline void ClearBackground(Color) {}
+inline void DrawRectangle(int, int, int, int, Color) {}
+inline Texture2D LoadTextureFromImage(Image image) { return {1, image.width, image.height, image.mipmaps, image.format}; }
+inline void UpdateTexture(Texture2D, const void*) {}
+inline void DrawTexture(Texture2D, int, int, Color) {}
+inline void UnloadTexture(Texture2D) {}
+
+#endif //__HEADLESS_H__
@@ -0,0 +1,118 @@
+#ifndef __HUGEPAGE_H__
+#define __HUGEPAGE_H__
+#include <new>
+#include <atomic>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+// 2MB page backing for large arrays that incoherent rays walk at random (spheres, BVH nodes, the framebuffer),
+// so a few TLB entries cover them. With TINYRT_HUGE_PAGES, mappings of at least huge_page_size try explicit
+// huge pages (MAP_HUGETLB, needs pages reserved in /proc/sys/vm/nr_hugepages) and fall back to a 2MB aligned
+// mapping advised with MADV_HUGEPAGE for transparent huge pages. Without it, or off Linux, nothing changes
+const size_t huge_page_size = size_t(2) << 20;
+
+// Bytes mapped by each path since startup
+struct HugePageStats {
+    std::atomic<size_t> explicit_bytes{0};    // MAP_HUGETLB
+    std::atomic<size_t> transparent_bytes{0}; // MADV_HUGEPAGE, the kernel may still back parts with small pages
+    std::atomic<size_t> regular_bytes{0};     // too small, disabled, or both huge page paths failed
+};
+
+inline HugePageStats& huge_page_stats() {
+    static HugePageStats stats;
+    return stats;
+}
+
+inline bool huge_pages_enabled() {
+#if defined(TINYRT_HUGE_PAGES) && defined(__linux__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Size of the mapping huge_page_map() makes for bytes
+inline size_t huge_page_mapped_size(size_t bytes) {
+    if (huge_pages_enabled() && bytes >= huge_page_size) return (bytes + huge_page_size - 1) & ~(huge_page_size - 1);
+    return bytes;
+}
+
+// Anonymous zero-filled mapping of huge_page_mapped_size(bytes), nullptr on failure or off Linux
+inline void* huge_page_map(size_t bytes) {
+#ifdef __linux__
+    HugePageStats& stats = huge_page_stats();
+    const size_t size = huge_page_mapped_size(bytes);
+    if (huge_pages_enabled() && bytes >= huge_page_size) {
+#ifdef MAP_HUGETLB
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            stats.explicit_bytes += size;
+            return p;
+        }
+#endif
+        // Over-map and trim so the range starts on a 2MB boundary, only aligned ranges get transparent huge pages
+        void* q = mmap(nullptr, size + huge_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (q == MAP_FAILED) return nullptr;
+        uintptr_t base = uintptr_t(q), aligned = (base + huge_page_size - 1) & ~uintptr_t(huge_page_size - 1);
+        if (aligned > base) munmap(q, aligned - base);
+        munmap(reinterpret_cast<void*>(aligned + size), base + huge_page_size - aligned);
+#ifdef MADV_HUGEPAGE
+        madvise(reinterpret_cast<void*>(aligned), size, MADV_HUGEPAGE); // failing just leaves small pages
+#endif
+        stats.transparent_bytes += size;
+        return reinterpret_cast<void*>(aligned);
+    }
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return nullptr;
+    stats.regular_bytes += size;
+    return p;
+#else
+    (void)bytes;
+    return nullptr;
+#endif
+}
+
+inline void huge_page_unmap(void* p, size_t bytes) {
+#ifdef __linux__
+    munmap(p, huge_page_mapped_size(bytes));
+#else
+    (void)p;
+    (void)bytes;
+#endif
+}
+
+// Allocator for containers of large arrays: big allocations go through huge_page_map(), small ones to operator new
+template <typename T> struct HugePageAllocator {
+    typedef T value_type;
+
+    HugePageAllocator() = default;
+    template <typename U> HugePageAllocator(const HugePageAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        const size_t bytes = n * sizeof(T);
+        if (uses_mapping(bytes)) {
+            if (void* p = huge_page_map(bytes)) return static_cast<T*>(p);
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(::operator new(bytes, std::align_val_t(alignof(T))));
+    }
+
+    void deallocate(T* p, size_t n) {
+        const size_t bytes = n * sizeof(T);
+        if (uses_mapping(bytes)) huge_page_unmap(p, bytes);
+        else ::operator delete(p, std::align_val_t(alignof(T)));
+    }
+
+    static bool uses_mapping(size_t bytes) { return huge_pages_enabled() && bytes >= huge_page_size; }
+
+    template <typename U> bool operator==(const HugePageAllocator<U>&) const { return true; }
+    template <typename U> bool operator!=(const HugePageAllocator<U>&) const { return false; }
+};
+
+template <typename T> using HugeVector = std::vector<T, HugePageAllocator<T>>;
+
+#endif //__HUGEPAGE_H__
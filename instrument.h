@@ -0,0 +1,313 @@
+#ifndef __INSTRUMENT_H__
+#define __INSTRUMENT_H__
+#include <cstdint>
+
+// Per-stage counters for tuning: wall time plus, through Linux perf_event_open, cycles, instructions, cache,
+// branch and dTLB misses and retired scalar/packed float ops (Intel only). Stages nest: shading is the trace
+// stage minus the intersection stage inside it. Scopes are per tile or ray chunk, as a sample costs a syscall per
+// counter group, so intersection is only split out by the streaming path, which intersects a chunk at a time; the
+// recursive one reports it as shading. Only compiled in with TINYRT_PERF, otherwise PerfScope is empty
+enum PerfStage { STAGE_RAYGEN, STAGE_TRACE, STAGE_INTERSECT, STAGE_PRESENT, STAGE_DENOISE, STAGE_COUNT };
+
+#ifdef TINYRT_PERF
+#include <vector>
+#include <string>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+enum PerfEvent { EVENT_CYCLES, EVENT_INSTRUCTIONS, EVENT_CACHE_MISSES, EVENT_BRANCH_MISSES, EVENT_DTLB_MISSES, EVENT_FP_SCALAR, EVENT_FP_PACKED, EVENT_COUNT };
+
+// Counts are raw until perf_frame_end(): enabled and running are the nanoseconds each event's group was enabled and
+// actually on the PMU, and scaled() extrapolates the counts of a multiplexed group by their ratio
+struct PerfTotals {
+    uint64_t calls = 0, ns = 0;
+    uint64_t events[EVENT_COUNT] = {};
+    uint64_t enabled[EVENT_COUNT] = {}, running[EVENT_COUNT] = {};
+
+    PerfTotals& operator+=(const PerfTotals& o) {
+        calls += o.calls;
+        ns += o.ns;
+        for (int e = 0; e < EVENT_COUNT; e++) {
+            events[e] += o.events[e];
+            enabled[e] += o.enabled[e];
+            running[e] += o.running[e];
+        }
+        return *this;
+    }
+    PerfTotals operator-(const PerfTotals& o) const {
+        PerfTotals d;
+        d.calls = calls;
+        d.ns = ns > o.ns ? ns - o.ns : 0;
+        for (int e = 0; e < EVENT_COUNT; e++) d.events[e] = events[e] > o.events[e] ? events[e] - o.events[e] : 0;
+        return d;
+    }
+    PerfTotals scaled() const {
+        PerfTotals s = *this;
+        for (int e = 0; e < EVENT_COUNT; e++) {
+            s.events[e] = running[e] ? uint64_t(double(events[e]) * enabled[e] / running[e] + .5) : 0;
+            s.enabled[e] = s.running[e] = 0;
+        }
+        return s;
+    }
+};
+
+// One reading of all counters of a thread
+struct PerfSample {
+    uint64_t count[EVENT_COUNT], enabled[EVENT_COUNT], running[EVENT_COUNT];
+};
+
+// The counters of one thread, opened as few groups as the PMU can schedule: cycles leads, and an event that doesn't
+// fit with it starts a group of its own. The kernel multiplexes whole groups, so the events of a group are counted
+// over the same intervals, and a sample costs one read() per group
+struct PerfThread {
+    int fd[EVENT_COUNT];
+    bool available[EVENT_COUNT];
+    int leader[EVENT_COUNT]; // fds of the group leaders, the first groups of them are open
+    int group[EVENT_COUNT], slot[EVENT_COUNT]; // where an event's value is in the reads
+    int groups = 0;
+    int error[EVENT_COUNT] = {}; // errno of an event that couldn't be opened, 0 if it doesn't exist on this CPU
+    PerfTotals stage[STAGE_COUNT];
+
+    PerfThread() {
+        int size[EVENT_COUNT] = {};
+        for (int e = 0; e < EVENT_COUNT; e++) {
+            fd[e] = -1;
+            for (int g = 0; g < groups && fd[e] < 0; g++) {
+                if ((fd[e] = open_event(PerfEvent(e), leader[g])) >= 0) {
+                    group[e] = g;
+                    slot[e] = size[g]++;
+                }
+            }
+            errno = 0;
+            if (fd[e] < 0 && (fd[e] = open_event(PerfEvent(e), -1)) >= 0) {
+                group[e] = groups;
+                slot[e] = size[groups]++;
+                leader[groups++] = fd[e];
+            }
+            available[e] = fd[e] >= 0;
+            if (!available[e]) error[e] = errno;
+        }
+    }
+
+    ~PerfThread() {
+#ifdef __linux__
+        for (int e = 0; e < EVENT_COUNT; e++) if (fd[e] >= 0) close(fd[e]);
+#endif
+    }
+
+    void read(PerfSample& sample) const {
+        std::memset(&sample, 0, sizeof(sample));
+#ifdef __linux__
+        uint64_t values[EVENT_COUNT][3 + EVENT_COUNT]; // PERF_FORMAT_GROUP: nr, time enabled, time running, counts
+        for (int g = 0; g < groups; g++) {
+            if (::read(leader[g], values[g], sizeof(values[g])) < ssize_t(3 * sizeof(uint64_t))) values[g][0] = 0;
+        }
+        for (int e = 0; e < EVENT_COUNT; e++) {
+            if (!available[e] || uint64_t(slot[e]) >= values[group[e]][0]) continue;
+            sample.enabled[e] = values[group[e]][1];
+            sample.running[e] = values[group[e]][2];
+            sample.count[e] = values[group[e]][3 + slot[e]];
+        }
+#endif
+    }
+
+private:
+    static int open_event(PerfEvent event, int group_fd) {
+#ifdef __linux__
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        switch (event) {
+            case EVENT_CYCLES:        attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+            case EVENT_INSTRUCTIONS:  attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+            case EVENT_CACHE_MISSES:  attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+            case EVENT_BRANCH_MISSES: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+            case EVENT_DTLB_MISSES:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+                break;
+            // FP_ARITH_INST_RETIRED (event 0xC7): scalar single, 128 and 256 bit packed single umasks
+            case EVENT_FP_SCALAR: if (!intel()) return -1; attr.type = PERF_TYPE_RAW; attr.config = 0x02C7; break;
+            case EVENT_FP_PACKED: if (!intel()) return -1; attr.type = PERF_TYPE_RAW; attr.config = 0x28C7; break;
+            default: return -1;
+        }
+        // This thread, any CPU. x86 refuses a member the group couldn't be scheduled with
+        return int(syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0));
+#else
+        (void)event;
+        (void)group_fd;
+        return -1;
+#endif
+    }
+
+    static bool intel() {
+#if defined(__x86_64__) || defined(__i386__)
+        unsigned a, b, c, d;
+        if (!__get_cpuid(0, &a, &b, &c, &d)) return false;
+        return b == 0x756e6547 && d == 0x49656e69 && c == 0x6c65746e; // "GenuineIntel"
+#else
+        return false;
+#endif
+    }
+};
+
+// Every thread that entered a scope, so the frame summary can sum them up
+struct PerfRegistry {
+    std::mutex mutex;
+    std::vector<PerfThread*> threads;
+    std::ofstream csv;
+    long frame = 0;
+    bool reported_missing = false;
+};
+
+inline PerfRegistry& perf_registry() {
+    static PerfRegistry registry;
+    return registry;
+}
+
+inline PerfThread& perf_thread() {
+    struct Registered {
+        PerfThread counters;
+        Registered() {
+            PerfRegistry& r = perf_registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            r.threads.push_back(&counters);
+        }
+        ~Registered() {
+            PerfRegistry& r = perf_registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            r.threads.erase(std::remove(r.threads.begin(), r.threads.end(), &counters), r.threads.end());
+        }
+    };
+    thread_local Registered registered;
+    return registered.counters;
+}
+
+// Adds the counters spent between construction and destruction to stage of the calling thread
+struct PerfScope {
+    explicit PerfScope(PerfStage stage) : stage(stage), thread(perf_thread()) {
+        thread.read(start);
+        start_time = std::chrono::steady_clock::now();
+    }
+
+    ~PerfScope() {
+        auto end_time = std::chrono::steady_clock::now();
+        PerfSample end;
+        thread.read(end);
+        PerfTotals& t = thread.stage[stage];
+        t.calls++;
+        t.ns += uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time).count());
+        for (int e = 0; e < EVENT_COUNT; e++) {
+            t.events[e] += end.count[e] - start.count[e];
+            t.enabled[e] += end.enabled[e] - start.enabled[e];
+            t.running[e] += end.running[e] - start.running[e];
+        }
+    }
+
+    PerfScope(const PerfScope&) = delete;
+    PerfScope& operator=(const PerfScope&) = delete;
+
+private:
+    PerfStage stage;
+    PerfThread& thread;
+    PerfSample start;
+    std::chrono::steady_clock::time_point start_time;
+};
+
+// Sums the stages over all threads, prints one line for the frame and appends a row per stage to the CSV
+// (TINYRT_PERF_CSV, perf.csv by default), then starts the next frame from zero. Call between frames
+inline void perf_frame_end() {
+    static const char* stage_names[] = {"raygen", "intersect", "shade", "present", "denoise"};
+    static const char* event_names[] = {"cycles", "instructions", "cache_misses", "branch_misses", "dtlb_misses", "fp_scalar", "fp_packed"};
+    PerfRegistry& r = perf_registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+
+    PerfTotals sum[STAGE_COUNT];
+    bool available[EVENT_COUNT] = {};
+    for (PerfThread* t : r.threads) {
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            sum[s] += t->stage[s].scaled(); // by the share of its own time each thread's groups were counted
+            t->stage[s] = PerfTotals();
+        }
+        for (int e = 0; e < EVENT_COUNT; e++) available[e] |= t->available[e];
+    }
+    // Once, which counters there are none of and why: VMs often expose no PMU (ENOENT), perf_event_paranoid may
+    // forbid them (EACCES), and the float op events only exist on Intel
+    if (!r.reported_missing && !r.threads.empty()) {
+        r.reported_missing = true;
+        for (int e = 0; e < EVENT_COUNT; e++) {
+            if (available[e]) continue;
+            const int error = r.threads[0]->error[e];
+            std::cerr << "perf: no " << event_names[e] << " counter (" << (error ? std::strerror(error) : "not on this CPU") << ")" << std::endl;
+        }
+    }
+    // Report shading exclusive of the intersection calls made while tracing
+    PerfTotals report[5] = {sum[STAGE_RAYGEN], sum[STAGE_INTERSECT], sum[STAGE_TRACE] - sum[STAGE_INTERSECT], sum[STAGE_PRESENT], sum[STAGE_DENOISE]};
+
+    if (!r.csv.is_open()) {
+        const char* path = std::getenv("TINYRT_PERF_CSV");
+        r.csv.open(path ? path : "perf.csv");
+        r.csv << "frame,stage,calls,ms";
+        for (const char* name : event_names) r.csv << ',' << name;
+        r.csv << ",ipc,simd_fraction\n";
+    }
+
+    std::cerr << "frame " << r.frame;
+    for (int s = 0; s < 5; s++) {
+        const PerfTotals& t = report[s];
+        const uint64_t* ev = t.events;
+        double ms = t.ns * 1e-6;
+        double ipc = ev[EVENT_CYCLES] ? double(ev[EVENT_INSTRUCTIONS]) / ev[EVENT_CYCLES] : 0;
+        double simd = ev[EVENT_FP_SCALAR] + ev[EVENT_FP_PACKED] ? double(ev[EVENT_FP_PACKED]) / (ev[EVENT_FP_SCALAR] + ev[EVENT_FP_PACKED]) : 0;
+
+        std::cerr << " | " << stage_names[s] << ' ' << std::fixed << std::setprecision(2) << ms << "ms";
+        if (available[EVENT_CYCLES] && available[EVENT_INSTRUCTIONS]) std::cerr << " ipc " << ipc;
+        if (available[EVENT_CACHE_MISSES]) std::cerr << " llc " << ev[EVENT_CACHE_MISSES];
+        if (available[EVENT_DTLB_MISSES]) std::cerr << " dtlb " << ev[EVENT_DTLB_MISSES];
+
+        r.csv << r.frame << ',' << stage_names[s] << ',' << t.calls << ',' << ms;
+        for (int e = 0; e < EVENT_COUNT; e++) {
+            r.csv << ',';
+            if (available[e]) r.csv << ev[e];
+        }
+        r.csv << ',';
+        if (available[EVENT_CYCLES] && available[EVENT_INSTRUCTIONS]) r.csv << ipc;
+        r.csv << ',';
+        if (available[EVENT_FP_SCALAR] && available[EVENT_FP_PACKED]) r.csv << simd;
+        r.csv << '\n';
+    }
+    std::cerr << std::defaultfloat << std::endl;
+    r.csv.flush();
+    r.frame++;
+}
+
+#else
+
+struct PerfScope {
+    explicit PerfScope(PerfStage) {}
+};
+
+inline void perf_frame_end() {}
+
+#endif
+
+#endif //__INSTRUMENT_H__
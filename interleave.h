@@ -0,0 +1,158 @@
+#ifndef __INTERLEAVE_H__
+#define __INTERLEAVE_H__
+#include <vector>
+#include <limits>
+#include <exception>
+#include <cstdint>
+#include <cassert>
+#include <cstddef>
+#include "bvh.h"
+
+// Memory level parallel BVH traversal: every ray's traversal is a coroutine that prefetches the node (or leaf
+// primitives) it is about to read and suspends. One thread resumes a window of them round-robin, so the miss of
+// one ray is served while the others compute. Needs C++20 coroutines, intersect_interleaved() falls back to
+// plain traversal otherwise
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+
+// Coroutine frames come and go once per ray, recycle them per thread instead of going to the heap
+struct FramePool {
+    size_t block_size = 0;
+    std::vector<void*> blocks;
+
+    void* allocate(size_t size) {
+        if (block_size == 0) block_size = size;
+        if (size > block_size) return ::operator new(size);
+        if (blocks.empty()) return ::operator new(block_size);
+        void* p = blocks.back();
+        blocks.pop_back();
+        return p;
+    }
+
+    void deallocate(void* p, size_t size) {
+        if (size > block_size) ::operator delete(p);
+        else blocks.push_back(p);
+    }
+
+    ~FramePool() { for (void* p : blocks) ::operator delete(p); }
+};
+
+inline FramePool& frame_pool() {
+    thread_local FramePool pool;
+    return pool;
+}
+
+struct TraversalTask {
+    struct promise_type {
+        TraversalTask get_return_object() { return TraversalTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+        static void* operator new(size_t size) { return frame_pool().allocate(size); }
+        static void operator delete(void* p, size_t size) { frame_pool().deallocate(p, size); }
+    };
+
+    TraversalTask() = default;
+    explicit TraversalTask(std::coroutine_handle<promise_type> h) : handle(h) {}
+    TraversalTask(TraversalTask&& o) noexcept : handle(o.handle) { o.handle = nullptr; }
+    TraversalTask& operator=(TraversalTask&& o) noexcept {
+        if (this != &o) {
+            if (handle) handle.destroy();
+            handle = o.handle;
+            o.handle = nullptr;
+        }
+        return *this;
+    }
+    TraversalTask(const TraversalTask&) = delete;
+    ~TraversalTask() { if (handle) handle.destroy(); }
+
+    bool active() const { return handle && !handle.done(); }
+    void resume() { handle.resume(); }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+// BVH::intersect() as a coroutine, same results. Children are prefetched as a pair since they sit side by side
+template <typename Prims> TraversalTask bvh_traversal(const BVH& bvh, Vec3f orig, Vec3f dir, const Prims& prims, float& t, int& prim, int ignore) {
+    const BVHNode* nodes = bvh.nodes.data();
+    const uint32_t* prim_ids = bvh.prim_ids.data();
+    t = std::numeric_limits<float>::max();
+    prim = -1;
+    if (bvh.nodes.empty()) co_return;
+
+    const Vec3f inv_dir(1 / dir.x, 1 / dir.y, 1 / dir.z);
+    uint32_t stack[BVH::max_depth];
+    float stack_t[BVH::max_depth];
+    int sp = 0;
+    float tnode;
+    if (!BVH::box_intersect(nodes[0], orig, inv_dir, t, tnode)) co_return;
+    uint32_t n = 0;
+    for (;;) {
+        const BVHNode& node = nodes[n];
+        if (node.count) {
+            for (uint32_t k = node.first; k < node.first + node.count; k++) prefetch(&prims[prim_ids[k]]);
+            co_await std::suspend_always();
+            for (uint32_t k = node.first; k < node.first + node.count; k++) {
+                float tk;
+                if (int(prim_ids[k]) != ignore && prims[prim_ids[k]].ray_intersect(orig, dir, tk) && tk < t) {
+                    t = tk;
+                    prim = int(prim_ids[k]);
+                }
+            }
+        }
+        else {
+            prefetch(&nodes[node.first]);
+            co_await std::suspend_always();
+            float tl, tr;
+            bool hl = BVH::box_intersect(nodes[node.first], orig, inv_dir, t, tl);
+            bool hr = BVH::box_intersect(nodes[node.first + 1], orig, inv_dir, t, tr);
+            if (hl && hr) {
+                bool left_first = tl <= tr;
+                assert(sp < BVH::max_depth);
+                stack[sp] = left_first ? node.first + 1 : node.first;
+                stack_t[sp++] = left_first ? tr : tl;
+                n = left_first ? node.first : node.first + 1;
+                continue;
+            }
+            if (hl || hr) {
+                n = hl ? node.first : node.first + 1;
+                continue;
+            }
+        }
+        do {
+            if (sp == 0) co_return;
+            n = stack[--sp];
+        } while (stack_t[sp] > t);
+    }
+}
+#endif
+
+// Closest hits of count rays, keeping up to window traversals in flight (the plain loop without coroutines)
+template <typename Prims> void intersect_interleaved(const BVH& bvh, const Vec3f* orig, const Vec3f* dir, const int* ignore, int count, const Prims& prims, float* t, int* prim, int window = 16) {
+#if defined(__cpp_impl_coroutine)
+    const int max_window = 64;
+    TraversalTask slots[max_window];
+    window = std::max(1, std::min(window, max_window));
+    int next = 0, active = 0;
+    for (; active < window && next < count; active++, next++) slots[active] = bvh_traversal(bvh, orig[next], dir[next], prims, t[next], prim[next], ignore[next]);
+    while (active > 0) {
+        for (int s = 0; s < active;) {
+            slots[s].resume();
+            if (slots[s].active()) { s++; continue; }
+            if (next < count) { // refill the slot with the next ray, it runs up to its first prefetch on the next round
+                slots[s] = bvh_traversal(bvh, orig[next], dir[next], prims, t[next], prim[next], ignore[next]);
+                next++;
+                s++;
+            }
+            else slots[s] = std::move(slots[--active]);
+        }
+    }
+#else
+    (void)window;
+    for (int r = 0; r < count; r++) bvh.intersect(orig[r], dir[r], prims, t[r], prim[r], ignore[r]);
+#endif
+}
+
+#endif //__INTERLEAVE_H__
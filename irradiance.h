@@ -0,0 +1,160 @@
+#ifndef __IRRADIANCE_H__
+#define __IRRADIANCE_H__
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <cmath>
+#include <cstdint>
+#include "geometry.h"
+
+// Cache of direct lighting at shading points: the diffuse term and the shadow visibility of every light.
+// Records live in a spatial hash of cells two radii wide and are interpolated within one radius when
+// the normal and primitive agree. Memory is bounded, each shard evicts its least recently used records
+struct IrradianceCache {
+    static const int max_lights = 8; // scenes with more lights bypass the cache
+    static const int shards = 16;    // independent locks, keyed by cell
+
+    struct Record {
+        Vec3f point, N;
+        int prim;
+        float diffuse;                 // sum of intensity * max(0, l.N) over the visible lights
+        float visibility[max_lights];  // fraction of each light seen, interpolated on lookup
+        uint64_t cell;
+        int prev, next;                // LRU list, most recent at the head
+    };
+
+    float radius = .25f;
+    float min_cos = .95f; // normals must agree this closely
+
+    explicit IrradianceCache(size_t capacity = 1 << 16) { resize(capacity); }
+
+    // Copies take the settings and capacity but start empty, records are only valid for the scene they were made in
+    IrradianceCache(const IrradianceCache& o) : radius(o.radius), min_cos(o.min_cos) { resize(o.capacity()); }
+    IrradianceCache& operator=(const IrradianceCache& o) {
+        radius = o.radius;
+        min_cos = o.min_cos;
+        if (capacity() != o.capacity()) resize(o.capacity());
+        else clear();
+        return *this;
+    }
+
+    size_t capacity() const { return shard[0].records.size() * shards; }
+
+    void resize(size_t capacity) {
+        for (Shard& s : shard) {
+            s.records.assign(std::max<size_t>(1, capacity / shards), Record());
+            s.reset();
+        }
+    }
+
+    void clear() {
+        for (Shard& s : shard) {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.reset();
+        }
+    }
+
+    // Weighted average of the records around point, false when none is close enough
+    bool lookup(const Vec3f& point, const Vec3f& N, int prim, int nlights, float& diffuse, float* visibility) {
+        float wsum = 0, dsum = 0, vsum[max_lights] = {};
+        int base[3]; // the 2x2x2 cells nearest to point, which reach at least one radius past it on every side
+        for (size_t a = 0; a < 3; a++) base[a] = int(std::floor(point[a] / (2 * radius) - .5f));
+        for (int dz = 0; dz < 2; dz++) for (int dy = 0; dy < 2; dy++) for (int dx = 0; dx < 2; dx++) {
+            uint64_t cell = cell_key(base[0] + dx, base[1] + dy, base[2] + dz);
+            Shard& s = shard[cell % shards];
+            std::lock_guard<std::mutex> lock(s.mutex);
+            auto it = s.cells.find(cell);
+            if (it == s.cells.end()) continue;
+            for (int r : it->second) {
+                Record& rec = s.records[r];
+                if (rec.prim != prim) continue;
+                float d = (rec.point - point).norm() / radius, c = rec.N * N;
+                if (d >= 1 || c <= min_cos) continue;
+                float w = (1 - d) * (c - min_cos) / (1 - min_cos);
+                wsum += w;
+                dsum += w * rec.diffuse;
+                for (int l = 0; l < nlights; l++) vsum[l] += w * rec.visibility[l];
+                s.touch(r);
+            }
+        }
+        if (wsum < 1e-3f) return false;
+        diffuse = dsum / wsum;
+        for (int l = 0; l < nlights; l++) visibility[l] = vsum[l] / wsum;
+        return true;
+    }
+
+    void insert(const Vec3f& point, const Vec3f& N, int prim, int nlights, float diffuse, const float* visibility) {
+        const float size = 2 * radius;
+        uint64_t cell = cell_key(int(std::floor(point.x / size)), int(std::floor(point.y / size)), int(std::floor(point.z / size)));
+        Shard& s = shard[cell % shards];
+        std::lock_guard<std::mutex> lock(s.mutex);
+        int r = s.allocate();
+        Record& rec = s.records[r];
+        rec.point = point;
+        rec.N = N;
+        rec.prim = prim;
+        rec.diffuse = diffuse;
+        for (int l = 0; l < nlights; l++) rec.visibility[l] = visibility[l];
+        rec.cell = cell;
+        s.cells[cell].push_back(r);
+    }
+
+private:
+    struct Shard {
+        std::mutex mutex;
+        std::vector<Record> records;
+        std::unordered_map<uint64_t, std::vector<int>> cells;
+        int head = -1, tail = -1, used = 0;
+
+        void reset() {
+            cells.clear();
+            head = tail = -1;
+            used = 0;
+        }
+
+        void unlink(int r) {
+            Record& rec = records[r];
+            if (rec.prev >= 0) records[rec.prev].next = rec.next; else head = rec.next;
+            if (rec.next >= 0) records[rec.next].prev = rec.prev; else tail = rec.prev;
+        }
+
+        void push_front(int r) {
+            records[r].prev = -1;
+            records[r].next = head;
+            if (head >= 0) records[head].prev = r;
+            head = r;
+            if (tail < 0) tail = r;
+        }
+
+        void touch(int r) {
+            if (r == head) return;
+            unlink(r);
+            push_front(r);
+        }
+
+        // A free record, or the least recently used one once the shard is full
+        int allocate() {
+            int r;
+            if (used < int(records.size())) r = used++;
+            else {
+                r = tail;
+                unlink(r);
+                std::vector<int>& list = cells[records[r].cell];
+                for (size_t i = 0; i < list.size(); i++) if (list[i] == r) { list[i] = list.back(); list.pop_back(); break; }
+                if (list.empty()) cells.erase(records[r].cell);
+            }
+            push_front(r);
+            return r;
+        }
+    };
+    Shard shard[shards];
+
+    static uint64_t cell_key(int x, int y, int z) {
+        uint64_t h = uint64_t(uint32_t(x)) * 0x9E3779B97F4A7C15ull;
+        h ^= uint64_t(uint32_t(y)) * 0xC2B2AE3D27D4EB4Full + (h << 6) + (h >> 2);
+        h ^= uint64_t(uint32_t(z)) * 0x165667B19E3779F9ull + (h << 6) + (h >> 2);
+        return h;
+    }
+};
+
+#endif //__IRRADIANCE_H__
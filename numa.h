@@ -0,0 +1,220 @@
+#ifndef __NUMA_H__
+#define __NUMA_H__
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <fstream>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "hugepage.h"
+
+inline int worker_id() {
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+inline int worker_count() {
+#ifdef _OPENMP
+    return omp_get_num_threads();
+#else
+    return 1;
+#endif
+}
+
+// CPUs of every memory node, read from /sys and restricted to the CPUs this process may run on.
+// Machines without NUMA (or without /sys) show up as a single node holding every CPU
+struct NumaTopology {
+    std::vector<std::vector<int>> node_cpus;
+
+    static NumaTopology detect() {
+        NumaTopology topo;
+#ifdef __linux__
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        bool have_mask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+        for (int node = 0;; node++) {
+            std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (!in) break;
+            std::vector<int> cpus;
+            std::string range;
+            while (std::getline(in, range, ',')) { // "0-3,8-11"
+                int lo = 0, hi = -1;
+                int fields = std::sscanf(range.c_str(), "%d-%d", &lo, &hi);
+                if (fields < 1) continue;
+                if (fields == 1) hi = lo;
+                for (int c = lo; c <= hi; c++) if (!have_mask || (c < CPU_SETSIZE && CPU_ISSET(c, &allowed))) cpus.push_back(c);
+            }
+            if (!cpus.empty()) topo.node_cpus.push_back(cpus); // memory-only nodes have no workers to feed
+        }
+#endif
+        if (topo.node_cpus.empty()) {
+            topo.node_cpus.emplace_back();
+            for (int c = 0; c < int(std::max(1u, std::thread::hardware_concurrency())); c++) topo.node_cpus[0].push_back(c);
+        }
+        return topo;
+    }
+
+    int nodes() const { return int(node_cpus.size()); }
+
+    // Spreads count workers over the nodes in proportion to their CPUs
+    int node_of_worker(int worker, int count) const {
+        size_t total = 0;
+        for (const std::vector<int>& cpus : node_cpus) total += cpus.size();
+        size_t cpu = size_t(worker) * total / size_t(std::max(1, count));
+        for (int n = 0; n < nodes(); n++) {
+            if (cpu < node_cpus[n].size()) return n;
+            cpu -= node_cpus[n].size();
+        }
+        return nodes() - 1;
+    }
+
+    // Restricts the calling thread to the CPUs of node, so its first touches land in that node's memory
+    bool bind_thread(int node) const {
+#ifdef __linux__
+        if (nodes() < 2) return false;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int c : node_cpus[node]) CPU_SET(c, &set);
+        return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+        (void)node;
+        return false;
+#endif
+    }
+};
+
+// Page-granular storage that is mapped but left untouched, each page lands on the node of the first thread
+// to write it. Only meant for trivially copyable T, pages read back as zero bytes until touched. Backed by
+// huge pages when enabled, which coarsens placement to 2MB
+template <typename T> struct NumaBuffer {
+    NumaBuffer() = default;
+    NumaBuffer(const NumaBuffer&) = delete;
+    NumaBuffer& operator=(const NumaBuffer&) = delete;
+    ~NumaBuffer() { release(); }
+
+    void allocate(size_t count) {
+        release();
+        size = count;
+        bytes = std::max<size_t>(1, count * sizeof(T));
+        data = static_cast<T*>(huge_page_map(bytes));
+        mapped = data != nullptr;
+        if (!mapped) data = static_cast<T*>(std::calloc(1, bytes));
+    }
+
+    // Writes zeros over [first, last) from the calling thread
+    void first_touch(size_t first, size_t last) { if (last > first) std::memset(static_cast<void*>(data + first), 0, (last - first) * sizeof(T)); }
+
+    T& operator[](size_t i) { return data[i]; }
+    const T& operator[](size_t i) const { return data[i]; }
+
+    T* data = nullptr;
+    size_t size = 0;
+
+private:
+    size_t bytes = 0;
+    bool mapped = false;
+
+    void release() {
+        if (!data) return;
+        if (mapped) huge_page_unmap(data, bytes);
+        else std::free(data);
+        data = nullptr;
+        size = 0;
+    }
+};
+
+// Tiles split into one contiguous range per node, in the same order as the framebuffer stripes.
+// Workers drain the range of their own node and only then steal from the others
+struct TileScheduler {
+    std::atomic<int> stolen{0}; // tiles rendered away from their node, since the last reset
+
+    void reset(int tile_count, int node_count) {
+        nodes = std::max(1, node_count);
+        tiles = tile_count;
+        if (!queues || capacity < nodes) queues.reset(new Queue[nodes]), capacity = nodes;
+        for (int n = 0; n < nodes; n++) {
+            queues[n].next.store(begin(n), std::memory_order_relaxed);
+            queues[n].end = begin(n + 1);
+        }
+        stolen.store(0, std::memory_order_relaxed);
+    }
+
+    // First tile of node's range
+    int begin(int node) const { return int(int64_t(tiles) * node / nodes); }
+
+    // Next tile for a worker on node, -1 once every range is drained
+    int next(int node) {
+        for (int k = 0; k < nodes; k++) {
+            Queue& q = queues[(node + k) % nodes];
+            if (q.next.load(std::memory_order_relaxed) >= q.end) continue;
+            int tile = q.next.fetch_add(1, std::memory_order_relaxed);
+            if (tile >= q.end) continue;
+            if (k) stolen.fetch_add(1, std::memory_order_relaxed);
+            return tile;
+        }
+        return -1;
+    }
+
+private:
+    struct alignas(64) Queue { // one cache line per node, so the counters don't bounce between sockets
+        std::atomic<int> next{0};
+        int end = 0;
+    };
+    std::unique_ptr<Queue[]> queues;
+    int capacity = 0, nodes = 1, tiles = 0;
+};
+
+// System wide page allocation counters from /sys/devices/system/node/node*/numastat, summed over nodes.
+// numa_miss counts pages that had to be placed off their intended node, other_node pages allocated
+// on a node for a thread running on another one: both are remote memory for whoever touches them next
+struct NumaStats {
+    uint64_t numa_hit = 0, numa_miss = 0, local_node = 0, other_node = 0;
+
+    static NumaStats read() {
+        NumaStats s;
+        for (int node = 0;; node++) {
+            std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/numastat");
+            if (!in) break;
+            std::string key;
+            uint64_t value;
+            while (in >> key >> value) {
+                if (key == "numa_hit") s.numa_hit += value;
+                else if (key == "numa_miss") s.numa_miss += value;
+                else if (key == "local_node") s.local_node += value;
+                else if (key == "other_node") s.other_node += value;
+            }
+        }
+        return s;
+    }
+
+    NumaStats operator-(const NumaStats& o) const {
+        NumaStats d;
+        d.numa_hit = numa_hit - o.numa_hit;
+        d.numa_miss = numa_miss - o.numa_miss;
+        d.local_node = local_node - o.local_node;
+        d.other_node = other_node - o.other_node;
+        return d;
+    }
+
+    // Share of page allocations that ended up remote
+    double remote_fraction() const {
+        uint64_t total = local_node + other_node;
+        return total ? double(other_node) / total : 0.;
+    }
+};
+
+#endif //__NUMA_H__
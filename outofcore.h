@@ -0,0 +1,381 @@
+#ifndef __OUTOFCORE_H__
+#define __OUTOFCORE_H__
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <limits>
+#include <algorithm>
+#include <unordered_map>
+#include <fstream>
+#include <cstdint>
+#include <cassert>
+#include <cstring>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "geometry.h"
+#include "bvh.h"
+
+// Read-only view of a primitive array, what BVH::build() and intersect() need from a container
+template <typename Prim> struct ArrayView {
+    const Prim* data = nullptr;
+    size_t count = 0;
+
+    size_t size() const { return count; }
+    const Prim& operator[](size_t i) const { return data[i]; }
+};
+
+// Primitives of a file larger than memory, split into spatial bricks. Only the brick table and a top-level BVH
+// over the brick bounds stay resident; a brick is paged in from the memory-mapped file, and gets its own BVH,
+// the first time a ray reaches it. Resident bricks are bounded by a byte budget, least recently used ones are
+// dropped from the mapping (MADV_DONTNEED) and rebuilt when needed again.
+// The file holds trivially copyable Prims with bmin/bmax bounds and ray_intersect(orig, dir, t), see write().
+// Primitive ids and file offsets are 64-bit, only ids within a brick are 32-bit.
+// Only the batched intersect() shares brick loads between rays; the single-ray one walks the bricks each ray
+// crosses on its own, as the recursive renderer and shadow rays do. A resident brick is found without locking,
+// only loads and evictions take the mutex
+template <typename Prim> struct BrickedScene {
+    // Traffic since the last take_stats()
+    struct IOStats {
+        uint64_t bricks_loaded = 0;
+        uint64_t bytes_loaded = 0; // brick data paged into the working set
+        uint64_t bytes_read = 0;   // the part of it that was not in the page cache, i.e. storage reads
+        size_t bytes_resident = 0;
+    };
+
+    BrickedScene() = default;
+    BrickedScene(const BrickedScene&) = delete;
+    BrickedScene& operator=(const BrickedScene&) = delete;
+    ~BrickedScene() { close(); }
+
+    // Sorts prims along a Morton curve and cuts them into bricks of brick_size, each starting on a page boundary
+    static bool write(const std::string& path, std::vector<Prim> prims, size_t brick_size = 1 << 14) {
+        const float inf = std::numeric_limits<float>::max();
+        Vec3f cmin(inf, inf, inf), cmax(-inf, -inf, -inf);
+        for (const Prim& p : prims) {
+            Vec3f c = (p.bmin + p.bmax) * .5f;
+            cmin = Vec3f(std::min(cmin.x, c.x), std::min(cmin.y, c.y), std::min(cmin.z, c.z));
+            cmax = Vec3f(std::max(cmax.x, c.x), std::max(cmax.y, c.y), std::max(cmax.z, c.z));
+        }
+        Vec3f extent = cmax - cmin;
+        Vec3f scale(extent.x > 0 ? 1023.f / extent.x : 0, extent.y > 0 ? 1023.f / extent.y : 0, extent.z > 0 ? 1023.f / extent.z : 0);
+        std::vector<uint32_t> codes(prims.size());
+        std::vector<uint64_t> order(prims.size()); // prims in Morton order, ties kept in input order
+        for (size_t i = 0; i < prims.size(); i++) {
+            Vec3f c = (prims[i].bmin + prims[i].bmax) * .5f - cmin;
+            codes[i] = uint32_t(BVH::morton3(uint32_t(c.x * scale.x), uint32_t(c.y * scale.y), uint32_t(c.z * scale.z))); // 30 bits
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&codes](uint64_t a, uint64_t b) { return codes[a] < codes[b]; });
+
+        Header header;
+        header.prim_size = sizeof(Prim);
+        header.brick_count = uint32_t((prims.size() + brick_size - 1) / brick_size);
+        header.prim_count = prims.size();
+        header.table_offset = sizeof(Header);
+        std::vector<Brick> table(header.brick_count);
+        uint64_t offset = align(sizeof(Header) + table.size() * sizeof(Brick));
+        for (size_t b = 0; b < table.size(); b++) {
+            Brick& brick = table[b];
+            brick.first = b * brick_size;
+            brick.count = std::min<uint64_t>(brick_size, prims.size() - brick.first);
+            brick.offset = offset;
+            brick.bmin = Vec3f(inf, inf, inf);
+            brick.bmax = Vec3f(-inf, -inf, -inf);
+            for (uint64_t i = brick.first; i < brick.first + brick.count; i++) {
+                const Prim& p = prims[order[i]];
+                brick.bmin = Vec3f(std::min(brick.bmin.x, p.bmin.x), std::min(brick.bmin.y, p.bmin.y), std::min(brick.bmin.z, p.bmin.z));
+                brick.bmax = Vec3f(std::max(brick.bmax.x, p.bmax.x), std::max(brick.bmax.y, p.bmax.y), std::max(brick.bmax.z, p.bmax.z));
+            }
+            offset = align(offset + brick.count * sizeof(Prim));
+        }
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(Brick));
+        for (const Brick& brick : table) {
+            out.seekp(std::streamoff(brick.offset));
+            for (uint64_t i = brick.first; i < brick.first + brick.count; i++) out.write(reinterpret_cast<const char*>(&prims[order[i]]), sizeof(Prim));
+        }
+        return bool(out);
+    }
+
+    // budget bounds the resident brick data plus their BVHs
+    bool open(const std::string& path, size_t budget = size_t(1) << 30) {
+        close();
+#if defined(__unix__) || defined(__APPLE__)
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(Header)) { close(); return false; }
+        file_size = size_t(st.st_size);
+        void* p = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) { close(); return false; }
+        base = static_cast<const char*>(p);
+        madvise(p, file_size, MADV_RANDOM); // bricks are paged in explicitly, readahead past them is wasted
+
+        Header header;
+        std::memcpy(&header, base, sizeof(header));
+        if (std::memcmp(header.magic, Header().magic, sizeof(header.magic)) != 0 || header.prim_size != sizeof(Prim) ||
+            header.table_offset + header.brick_count * sizeof(Brick) > file_size) { close(); return false; }
+        bricks.resize(header.brick_count);
+        std::memcpy(bricks.data(), base + header.table_offset, bricks.size() * sizeof(Brick));
+        for (const Brick& brick : bricks) if (brick.offset + brick.count * sizeof(Prim) > file_size) { close(); return false; }
+        prim_count = header.prim_count;
+        resident.reset(new Slot[bricks.size()]);
+        resident_budget = budget;
+        top.build(bricks, BVH_SAH);
+        return true;
+#else
+        (void)path;
+        (void)budget;
+        return false;
+#endif
+    }
+
+    void close() {
+#if defined(__unix__) || defined(__APPLE__)
+        if (base) munmap(const_cast<char*>(base), file_size);
+        if (fd >= 0) ::close(fd);
+#endif
+        base = nullptr;
+        fd = -1;
+        bricks.clear();
+        resident.reset();
+        resident_bytes = 0;
+        prim_count = 0;
+    }
+
+    bool is_open() const { return base != nullptr; }
+    size_t size() const { return prim_count; }
+
+    // Primitive by id, pages its brick in if needed (the data stays valid while the file is open)
+    const Prim& operator[](size_t id) const {
+        size_t b = std::upper_bound(bricks.begin(), bricks.end(), uint64_t(id), [](uint64_t v, const Brick& brick) { return v < brick.first; }) - bricks.begin() - 1;
+        return view(b)[id - bricks[b].first];
+    }
+
+    // Closest hit along one ray, walking the bricks it crosses front to back. prim is -1 on a miss
+    bool intersect(const Vec3f& orig, const Vec3f& dir, float& t, int64_t& prim, int64_t ignore = -1) const {
+        thread_local std::vector<std::pair<float, uint32_t>> along; // reused, so rays don't allocate
+        bricks_along(orig, dir, along);
+        t = std::numeric_limits<float>::max();
+        prim = -1;
+        for (const std::pair<float, uint32_t>& hit : along) {
+            if (hit.first > t) break;
+            intersect_brick(hit.second, orig, dir, t, prim, ignore);
+        }
+        return prim >= 0;
+    }
+
+    // Closest hits of a batch: every ray is queued at the first brick it crosses, then the fullest queue is traced
+    // and its rays move on to their next brick until none is left. Each brick is paged in once per batch
+    void intersect(const Vec3f* orig, const Vec3f* dir, const int64_t* ignore, int count, float* t, int64_t* prim) const {
+        thread_local std::vector<std::vector<std::pair<float, uint32_t>>> along; // reused across batches
+        thread_local std::vector<size_t> cursor;
+        if (int(along.size()) < count) along.resize(count);
+        cursor.assign(count, 0);
+        std::unordered_map<uint32_t, std::vector<int>> queues;
+        auto advance = [&](int r) {
+            const std::vector<std::pair<float, uint32_t>>& a = along[r];
+            if (cursor[r] < a.size() && a[cursor[r]].first <= t[r]) queues[a[cursor[r]++].second].push_back(r);
+        };
+        for (int r = 0; r < count; r++) {
+            t[r] = std::numeric_limits<float>::max();
+            prim[r] = -1;
+            bricks_along(orig[r], dir[r], along[r]);
+            advance(r);
+        }
+        while (!queues.empty()) {
+            auto fullest = queues.begin();
+            for (auto it = queues.begin(); it != queues.end(); ++it) if (it->second.size() > fullest->second.size()) fullest = it;
+            const uint32_t b = fullest->first;
+            std::vector<int> rays;
+            rays.swap(fullest->second);
+            queues.erase(fullest);
+            std::shared_ptr<const Resident> r = acquire(b);
+            for (int k : rays) {
+                intersect_brick(b, *r, orig[k], dir[k], t[k], prim[k], ignore[k]);
+                advance(k);
+            }
+        }
+    }
+
+    IOStats take_stats() const {
+        IOStats s;
+        s.bricks_loaded = stats_bricks.exchange(0);
+        s.bytes_loaded = stats_loaded.exchange(0);
+        s.bytes_read = stats_read.exchange(0);
+        std::lock_guard<std::mutex> lock(mutex);
+        s.bytes_resident = resident_bytes;
+        return s;
+    }
+
+private:
+    struct Header {
+        char magic[8] = {'T', 'R', 'T', 'B', 'R', 'K', '0', '2'}; // the digits version the primitive layout, which prim_size can't tell
+        uint32_t prim_size = 0;
+        uint32_t brick_count = 0;
+        uint64_t prim_count = 0;
+        uint64_t table_offset = 0;
+    };
+
+    struct Brick {
+        Vec3f bmin, bmax;
+        uint64_t first;  // id of the first primitive
+        uint64_t count;
+        uint64_t offset; // file offset of the primitives, page aligned
+    };
+
+    struct Resident {
+        BVH bvh;
+        size_t bytes;
+    };
+
+    // Residency of a brick. data is only stored to under the mutex, but loaded without it; last_use is the load
+    // count when a ray last reached the brick, so the bricks used since the last load all look equally recent
+    struct Slot {
+        std::atomic<std::shared_ptr<const Resident>> data;
+        std::atomic<uint64_t> last_use{0};
+    };
+
+    int fd = -1;
+    const char* base = nullptr;
+    size_t file_size = 0, prim_count = 0;
+    std::vector<Brick> bricks;
+    BVH top; // over the brick bounds
+
+    mutable std::unique_ptr<Slot[]> resident; // one per brick
+    mutable std::atomic<uint64_t> loads{0};
+    mutable std::mutex mutex; // serializes loads and evictions, guards resident_bytes
+    mutable size_t resident_bytes = 0;
+    size_t resident_budget = 0;
+    mutable std::atomic<uint64_t> stats_bricks{0}, stats_loaded{0}, stats_read{0};
+
+    static uint64_t align(uint64_t offset) { return (offset + 4095) & ~uint64_t(4095); }
+
+    ArrayView<Prim> view(size_t b) const {
+        ArrayView<Prim> v;
+        v.data = reinterpret_cast<const Prim*>(base + bricks[b].offset);
+        v.count = size_t(bricks[b].count);
+        return v;
+    }
+
+    // Bricks whose bounds the ray crosses, sorted by entry distance
+    void bricks_along(const Vec3f& orig, const Vec3f& dir, std::vector<std::pair<float, uint32_t>>& along) const {
+        along.clear();
+        if (top.nodes.empty()) return;
+        const Vec3f inv_dir(1 / dir.x, 1 / dir.y, 1 / dir.z);
+        const float inf = std::numeric_limits<float>::max();
+        uint32_t stack[BVH::max_depth + 1]; // both children are pushed, so one more than the depth
+        int sp = 0;
+        stack[sp++] = 0;
+        while (sp) {
+            const BVHNode& node = top.nodes[stack[--sp]];
+            float tnear;
+            if (!BVH::box_intersect(node, orig, inv_dir, inf, tnear)) continue;
+            if (!node.count) {
+                assert(sp < BVH::max_depth);
+                stack[sp++] = node.first;
+                stack[sp++] = node.first + 1;
+                continue;
+            }
+            for (uint32_t k = node.first; k < node.first + node.count; k++) {
+                BVHNode bounds;
+                bounds.bmin = bricks[top.prim_ids[k]].bmin;
+                bounds.bmax = bricks[top.prim_ids[k]].bmax;
+                if (BVH::box_intersect(bounds, orig, inv_dir, inf, tnear)) along.emplace_back(tnear, top.prim_ids[k]);
+            }
+        }
+        std::sort(along.begin(), along.end());
+    }
+
+    void intersect_brick(uint32_t b, const Vec3f& orig, const Vec3f& dir, float& t, int64_t& prim, int64_t ignore) const {
+        std::shared_ptr<const Resident> r = acquire(b);
+        intersect_brick(b, *r, orig, dir, t, prim, ignore);
+    }
+
+    void intersect_brick(uint32_t b, const Resident& r, const Vec3f& orig, const Vec3f& dir, float& t, int64_t& prim, int64_t ignore) const {
+        const Brick& brick = bricks[b];
+        int local_ignore = ignore >= 0 && uint64_t(ignore) >= brick.first && uint64_t(ignore) < brick.first + brick.count ? int(ignore - brick.first) : -1;
+        float tb;
+        int pb;
+        if (r.bvh.intersect(orig, dir, view(b), tb, pb, local_ignore) && tb < t) {
+            t = tb;
+            prim = int64_t(brick.first) + pb;
+        }
+    }
+
+    // The brick's BVH, paging the brick in and building it if it is not resident. A hit only reads the slot and
+    // stamps it, the stamp is only written when it changes so bricks in use don't bounce their cache line around
+    std::shared_ptr<const Resident> acquire(uint32_t b) const {
+        Slot& slot = resident[b];
+        const uint64_t now = loads.load(std::memory_order_relaxed);
+        if (slot.last_use.load(std::memory_order_relaxed) != now) slot.last_use.store(now, std::memory_order_relaxed);
+        if (std::shared_ptr<const Resident> r = slot.data.load(std::memory_order_acquire)) return r;
+
+        const Brick& brick = bricks[b];
+        const size_t bytes = size_t(brick.count * sizeof(Prim));
+        stats_read += non_resident_bytes(base + brick.offset, bytes);
+#if defined(__unix__) || defined(__APPLE__)
+        madvise(const_cast<char*>(base + brick.offset), bytes, MADV_WILLNEED);
+#endif
+        std::shared_ptr<Resident> r = std::make_shared<Resident>();
+        r->bvh.build(view(b), BVH_LBVH);
+        r->bytes = bytes + r->bvh.bytes();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (std::shared_ptr<const Resident> loaded = slot.data.load(std::memory_order_acquire)) return loaded; // another thread loaded it meanwhile
+        stats_bricks++;
+        stats_loaded += bytes;
+        slot.data.store(r, std::memory_order_release);
+        slot.last_use.store(loads.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        resident_bytes += r->bytes;
+        // Evict the least recently used bricks that no ray holds. A ray that loads a victim's slot just before it is
+        // cleared keeps the BVH alive and only has its pages faulted back in
+        while (resident_bytes > resident_budget) {
+            uint32_t victim = b;
+            uint64_t oldest = std::numeric_limits<uint64_t>::max();
+            std::shared_ptr<const Resident> held;
+            for (uint32_t i = 0; i < bricks.size(); i++) {
+                const uint64_t stamp = resident[i].last_use.load(std::memory_order_relaxed);
+                if (i == b || stamp >= oldest) continue;
+                std::shared_ptr<const Resident> candidate = resident[i].data.load(std::memory_order_relaxed);
+                if (!candidate || candidate.use_count() > 2) continue; // not resident, or still being traced
+                victim = i;
+                oldest = stamp;
+                held = std::move(candidate);
+            }
+            if (victim == b) break;
+            resident_bytes -= held->bytes;
+            resident[victim].data.store(nullptr, std::memory_order_relaxed);
+#if defined(__unix__) || defined(__APPLE__)
+            madvise(const_cast<char*>(base + bricks[victim].offset), size_t(bricks[victim].count * sizeof(Prim)), MADV_DONTNEED);
+#endif
+        }
+        return r;
+    }
+
+    // Bytes of [p, p + bytes) that are not in the page cache, so touching them reads storage
+    static uint64_t non_resident_bytes(const char* p, size_t bytes) {
+#if defined(__linux__)
+        const size_t page = size_t(sysconf(_SC_PAGESIZE));
+        std::vector<unsigned char> in_core((bytes + page - 1) / page);
+        if (in_core.empty() || mincore(const_cast<char*>(p), bytes, in_core.data()) != 0) return bytes;
+        uint64_t missing = 0;
+        for (unsigned char c : in_core) if (!(c & 1)) missing += page;
+        return std::min<uint64_t>(missing, bytes);
+#else
+        (void)p;
+        return bytes;
+#endif
+    }
+};
+
+#endif //__OUTOFCORE_H__
@@ -0,0 +1,185 @@
+#ifndef __RAYQUEUE_H__
+#define __RAYQUEUE_H__
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <thread>
+#include "geometry.h"
+
+// Footprint of a ray as a cone (Akenine-Moller et al., "Texture Level of Detail Strategies for Real-Time Ray
+// Tracing"): its width where it starts and how fast that grows with distance, in radians. Texture and environment
+// lookups pick their mip level from it
+struct RayCone {
+    float width = 0;
+    float spread = 0;
+
+    float width_at(float t) const { return width + spread * t; }
+};
+
+// A ray waiting to be traced by the streaming renderer: what it adds to its pixel is throughput times its radiance.
+// Not called Ray, raylib.h defines one
+struct QueuedRay {
+    Vec3f orig, dir;
+    Vec3f throughput;
+    uint32_t pixel;  // framebuffer index
+    int32_t ignore;  // primitive the ray leaves, see spawn_ray()
+    int32_t depth;   // bounces left, the background is returned below 0
+    RayCone cone;
+};
+
+// Rays stored as structure of arrays, so a chunk can be streamed through the traversal component by component
+template <int N> struct RayChunkT {
+    static const int capacity = N;
+    float ox[N], oy[N], oz[N];
+    float dx[N], dy[N], dz[N];
+    float tr[N], tg[N], tb[N];
+    uint32_t pixel[N];
+    int32_t ignore[N];
+    int32_t depth[N];
+    float cone_width[N], cone_spread[N];
+    int size = 0;
+
+    bool full() const { return size == N; }
+
+    void push(const QueuedRay& r) {
+        const int i = size++;
+        ox[i] = r.orig.x; oy[i] = r.orig.y; oz[i] = r.orig.z;
+        dx[i] = r.dir.x; dy[i] = r.dir.y; dz[i] = r.dir.z;
+        tr[i] = r.throughput.x; tg[i] = r.throughput.y; tb[i] = r.throughput.z;
+        pixel[i] = r.pixel;
+        ignore[i] = r.ignore;
+        depth[i] = r.depth;
+        cone_width[i] = r.cone.width;
+        cone_spread[i] = r.cone.spread;
+    }
+
+    QueuedRay operator[](int i) const {
+        QueuedRay r;
+        r.orig = Vec3f(ox[i], oy[i], oz[i]);
+        r.dir = Vec3f(dx[i], dy[i], dz[i]);
+        r.throughput = Vec3f(tr[i], tg[i], tb[i]);
+        r.pixel = pixel[i];
+        r.ignore = ignore[i];
+        r.depth = depth[i];
+        r.cone.width = cone_width[i];
+        r.cone.spread = cone_spread[i];
+        return r;
+    }
+};
+typedef RayChunkT<64> RayChunk;
+
+// Bounded multi-producer/multi-consumer queue (Vyukov). Every cell carries a sequence number telling producers
+// and consumers whose turn it is, so push and pop are a single CAS on their cursor and never block each other
+template <typename T> struct MPMCQueue {
+    explicit MPMCQueue(size_t capacity = 1024) { reset(capacity); }
+
+    // Not thread safe, capacity is rounded up to a power of two
+    void reset(size_t capacity) {
+        size_t n = 2;
+        while (n < capacity) n *= 2;
+        mask = n - 1;
+        cells.reset(new Cell[n]);
+        for (size_t i = 0; i < n; i++) cells[i].sequence.store(i, std::memory_order_relaxed);
+        enqueue_pos.store(0, std::memory_order_relaxed);
+        dequeue_pos.store(0, std::memory_order_relaxed);
+    }
+
+    // False when full, and also while the pop of the same cell one lap earlier is still in progress: a consumer
+    // stalled between claiming a cell and releasing it makes it look full to producers that have lapped it
+    bool push(const T& value) {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[pos & mask];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = intptr_t(seq) - intptr_t(pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0) return false;
+            else pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    // False when empty
+    bool pop(T& value) {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[pos & mask];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = intptr_t(seq) - intptr_t(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    value = cell.value;
+                    cell.sequence.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0) return false;
+            else pos = dequeue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+    std::unique_ptr<Cell[]> cells;
+    size_t mask = 0;
+    alignas(64) std::atomic<size_t> enqueue_pos{0}; // producers and consumers each get their own cache line
+    alignas(64) std::atomic<size_t> dequeue_pos{0};
+};
+
+// Fixed pool of ray chunks passed between threads by index: free chunks wait in one queue, filled ones in the
+// other. pending counts the filled chunks not yet fully traced, which is how consumers know the stream ran dry.
+// Each queue can hold the whole pool, so a failed push is only ever a stalled pop and is retried
+struct RayStream {
+    std::vector<RayChunk> chunks;
+    MPMCQueue<uint32_t> free_chunks, full_chunks;
+    std::atomic<long> pending{0};
+
+    explicit RayStream(size_t count = 1024) { reset(count); }
+
+    void reset(size_t count) {
+        chunks.assign(count, RayChunk());
+        free_chunks.reset(count);
+        full_chunks.reset(count);
+        for (uint32_t c = 0; c < count; c++) free_chunks.push(c);
+        pending.store(0);
+    }
+
+    // An empty chunk, or -1 when the pool is exhausted
+    int acquire() {
+        uint32_t c;
+        if (!free_chunks.pop(c)) return -1;
+        chunks[c].size = 0;
+        return int(c);
+    }
+
+    void submit(int c) {
+        pending.fetch_add(1, std::memory_order_relaxed);
+        push(full_chunks, c);
+    }
+
+    // Returns an acquired chunk that ended up unused
+    void release_empty(int c) { push(free_chunks, c); }
+
+    // Call once the rays of a popped chunk have all been traced and their secondary rays submitted
+    void release(int c) {
+        push(free_chunks, c);
+        pending.fetch_sub(1, std::memory_order_release);
+    }
+
+private:
+    static void push(MPMCQueue<uint32_t>& queue, int c) {
+        while (!queue.push(uint32_t(c))) std::this_thread::yield();
+    }
+};
+
+#endif //__RAYQUEUE_H__
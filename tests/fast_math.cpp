@@ -0,0 +1,74 @@
+// Sweeps the fast-math approximations of geometry.h over their input ranges and checks each against the error
+// bound its comment documents, computing the reference in double precision
+#include <cmath>
+#include <cstdio>
+#include <cfloat>
+#include "geometry.h"
+
+static int failures = 0;
+
+// Worst error seen over a sweep, reported with the input it was seen at
+struct MaxError {
+    const char* name;
+    double bound, max = 0, at = 0;
+
+    void add(double error, double input) {
+        if (!(error <= max)) { max = error; at = input; } // also catches NaN
+    }
+
+    ~MaxError() {
+        const bool ok = max <= bound;
+        std::printf("%-10s max error %.3g (at %.9g), bound %.3g  %s\n", name, max, at, bound, ok ? "ok" : "FAILED");
+        if (!ok) failures++;
+    }
+};
+
+double relative(double approx, double exact) { return std::fabs(approx - exact) / std::fabs(exact); }
+
+int main() {
+    {   // 1/sqrt(x), relative error below 1e-6, over the normal floats
+        MaxError e = {"rsqrt", 1e-6};
+        for (float x = FLT_MIN; x < FLT_MAX / 1.0001f; x *= 1.0001f) e.add(relative(fast_rsqrt(x), 1 / std::sqrt(double(x))), x);
+    }
+    {   // log2(x), absolute error below 1e-6 beyond the rounding of the result, over the normal floats
+        MaxError e = {"log2", 1e-6};
+        for (float x = FLT_MIN; x < FLT_MAX / 1.0001f; x *= 1.0001f) {
+            const double exact = std::log2(double(x));
+            e.add(std::fabs(fast_log2(x) - exact) - std::fabs(exact) * std::ldexp(1., -24), x);
+        }
+    }
+    {   // 2^x, relative error below 1e-5 wherever the result is a normal float
+        MaxError e = {"exp2", 1e-5};
+        for (float x = -125.99f; x <= 127.f; x += 1.f / 4096) e.add(relative(fast_exp2(x), std::exp2(double(x))), x);
+        if (fast_exp2(-127.f) != 0.f) e.add(1, -127.);
+    }
+    {   // x^e for x in [0, 1], relative error below 2e-5 for the specular exponents in use (up to 1425)
+        MaxError e = {"pow", 2e-5};
+        for (float exponent : {1.f, 2.f, 10.f, 50.f, 125.f, 1425.f}) {
+            for (float x = 1e-6f; x <= 1.f; x += 1.f / 65536) {
+                const double exact = std::pow(double(x), double(exponent));
+                if (exact < FLT_MIN) continue; // flushed to 0 by fast_exp2
+                e.add(relative(fast_pow(x, exponent), exact), x);
+            }
+        }
+        if (fast_pow(0.f, 10.f) != 0.f || fast_pow(0.f, 0.f) != 1.f) e.add(1, 0.);
+    }
+    {   // atan2(y, x), absolute error below 1e-5 radians, around the whole circle at several radii
+        MaxError e = {"atan2", 1e-5};
+        for (float r : {1e-3f, 1.f, 1e3f}) {
+            for (int k = 0; k < 1 << 20; k++) {
+                const double a = 2 * M_PI * k / (1 << 20) - M_PI;
+                const float y = float(r * std::sin(a)), x = float(r * std::cos(a));
+                e.add(std::fabs(fast_atan2(y, x) - std::atan2(double(y), double(x))), a);
+            }
+        }
+    }
+    {   // acos(x), absolute error below 1e-4 radians, over [-1, 1]
+        MaxError e = {"acos", 1e-4};
+        for (int k = -(1 << 20); k <= 1 << 20; k++) {
+            const float x = float(k) / (1 << 20);
+            e.add(std::fabs(fast_acos(x) - std::acos(double(x))), x);
+        }
+    }
+    return failures ? 1 : 0;
+}
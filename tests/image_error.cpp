@@ -0,0 +1,51 @@
+// Error of an image against a reference, both binary PPMs as the headless renderer saves them (--save): RMSE over
+// the channel values in [0, 1], the PSNR, and how many values are off by more than one 8-bit level. Exits 1 when
+// the RMSE is above the bound given, so ctest can hold an approximation (LOD, upscaling) to a stated error
+//   test_image_error <reference.ppm> <image.ppm> <max rmse>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// The pixels of a P6 file with 8-bit channels, empty if it isn't one
+std::vector<unsigned char> load(const char* path, int& w, int& h) {
+    std::ifstream file(path, std::ios::binary);
+    std::string magic;
+    int max = 0;
+    file >> magic >> w >> h >> max;
+    file.get(); // the single whitespace before the pixels
+    std::vector<unsigned char> pixels;
+    if (!file || magic != "P6" || max != 255 || w <= 0 || h <= 0) return pixels;
+    pixels.resize(size_t(w) * h * 3);
+    if (!file.read(reinterpret_cast<char*>(pixels.data()), pixels.size())) pixels.clear();
+    return pixels;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 4) {
+        std::fprintf(stderr, "usage: %s <reference.ppm> <image.ppm> <max rmse>\n", argv[0]);
+        return 2;
+    }
+    int w0, h0, w1, h1;
+    const std::vector<unsigned char> reference = load(argv[1], w0, h0), image = load(argv[2], w1, h1);
+    if (reference.empty() || image.empty() || w0 != w1 || h0 != h1) {
+        std::fprintf(stderr, "can't compare %s and %s\n", argv[1], argv[2]);
+        return 2;
+    }
+    const double bound = std::atof(argv[3]);
+
+    double sum = 0;
+    size_t off = 0;
+    for (size_t i = 0; i < image.size(); i++) {
+        const int d = int(image[i]) - int(reference[i]);
+        sum += double(d) * d;
+        off += std::abs(d) > 1;
+    }
+    const double rmse = std::sqrt(sum / image.size()) / 255;
+    const bool ok = rmse <= bound;
+    std::printf("%s: RMSE %.5f (PSNR %.2f dB), %zu of %zu values off by more than one level, bound %.5f  %s\n", argv[2],
+                rmse, rmse > 0 ? -20 * std::log10(rmse) : INFINITY, off, image.size(), bound, ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,183 @@
+// Stress test of the lock-free ray queue: many threads push and pop through MPMCQueue and pass chunks around a
+// RayStream the way render_stream() does, and every item must come out exactly once. Small capacities keep the
+// queues wrapping around and running full and empty all the time
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include "rayqueue.h"
+
+static int failures = 0;
+
+void check(bool ok, const char* what, int threads) {
+    std::printf("%-40s %2d threads  %s\n", what, threads, ok ? "ok" : "FAILED");
+    if (!ok) failures++;
+}
+
+template <typename F> void run_threads(int count, F f) {
+    std::vector<std::thread> threads;
+    for (int i = 0; i < count; i++) threads.emplace_back(f, i);
+    for (std::thread& t : threads) t.join();
+}
+
+// Producers push their ids in order, consumers pop until the producers are done and the queue is empty. Each value must be popped once, and a
+// consumer must see the values of any one producer in the order they were pushed
+void queue_stress(int producers, int consumers, uint32_t per_producer, size_t capacity) {
+    MPMCQueue<uint32_t> queue(capacity);
+    const uint32_t total = producers * per_producer;
+    std::vector<std::atomic<uint8_t>> seen(total);
+    std::atomic<int> producing{producers};
+    std::atomic<bool> ordered{true};
+
+    run_threads(producers + consumers, [&](int thread) {
+        if (thread < producers) {
+            for (uint32_t k = 0; k < per_producer; k++)
+                while (!queue.push(thread * per_producer + k)) std::this_thread::yield();
+            producing.fetch_sub(1, std::memory_order_release);
+            return;
+        }
+        std::vector<long> last(producers, -1);
+        uint32_t value;
+        for (;;) {
+            const bool done = producing.load(std::memory_order_acquire) == 0; // read first: a pop failing after that means drained
+            if (!queue.pop(value)) {
+                if (done) break;
+                std::this_thread::yield();
+                continue;
+            }
+            if (value < total) seen[value].fetch_add(1, std::memory_order_relaxed);
+            const uint32_t producer = value / per_producer, k = value % per_producer;
+            if (producer < uint32_t(producers)) {
+                if (long(k) <= last[producer]) ordered = false;
+                last[producer] = k;
+            }
+        }
+    });
+
+    bool once = true;
+    for (uint32_t v = 0; v < total; v++) once &= seen[v].load() == 1;
+    uint32_t extra;
+    check(once && !queue.pop(extra), "MPMCQueue: every value popped once", producers + consumers);
+    check(ordered, "MPMCQueue: per-producer order kept", producers + consumers);
+}
+
+// Workers mimic render_stream(): start tiles of primary rays, trace filled chunks by spawning a secondary ray per
+// ray until the depth runs out, finish rays inline when the pool is exhausted, and stop once nothing is pending.
+// Every (pixel, depth) pair must be traced once, and no chunk may be held by two workers at a time
+void stream_stress(int workers, uint32_t pixels, int depth, size_t pool) {
+    RayStream stream(pool);
+    std::vector<std::atomic<uint8_t>> traced(size_t(pixels) * (depth + 1));
+    std::vector<std::atomic<uint8_t>> held(pool);
+    std::atomic<uint64_t> next_tile{0}; // idle workers keep drawing from it, so it runs past the last tile
+    std::atomic<bool> exclusive{true};
+    const uint32_t tile = 48; // not a multiple of the chunk size, so tiles leave partly filled chunks behind
+
+    auto take = [&](int c) { if (held[c].exchange(1)) exclusive = false; };
+    auto give = [&](int c) { if (!held[c].exchange(0)) exclusive = false; };
+    auto record = [&](const QueuedRay& ray) {
+        if (ray.pixel < pixels && ray.depth >= 0 && ray.depth <= depth) traced[size_t(ray.pixel) * (depth + 1) + ray.depth]++;
+    };
+
+    run_threads(workers, [&](int) {
+        int out = -1;
+        auto flush = [&]() {
+            if (out >= 0) give(out);
+            if (out >= 0 && stream.chunks[out].size) stream.submit(out);
+            else if (out >= 0) stream.release_empty(out);
+            out = -1;
+        };
+        auto emit = [&](QueuedRay ray) {
+            if (out < 0 && (out = stream.acquire()) >= 0) take(out);
+            if (out < 0) { // pool exhausted, the ray and its descendants are traced on the spot
+                for (; ray.depth >= 0; ray.depth--) record(ray);
+                return;
+            }
+            stream.chunks[out].push(ray);
+            if (stream.chunks[out].full()) flush();
+        };
+        for (;;) {
+            uint32_t c;
+            uint64_t t;
+            if (stream.full_chunks.pop(c)) {
+                take(int(c));
+                const RayChunk& chunk = stream.chunks[c];
+                for (int k = 0; k < chunk.size; k++) {
+                    QueuedRay ray = chunk[k];
+                    record(ray);
+                    ray.depth--;
+                    if (ray.depth >= 0) emit(ray);
+                }
+                flush();
+                give(int(c));
+                stream.release(int(c));
+            }
+            else if ((t = next_tile.fetch_add(1)) * tile < pixels) {
+                QueuedRay ray{};
+                ray.depth = depth;
+                for (uint64_t p = t * tile; p < std::min<uint64_t>(pixels, (t + 1) * tile); p++) {
+                    ray.pixel = uint32_t(p);
+                    emit(ray);
+                }
+                flush();
+            }
+            else if (stream.pending.load(std::memory_order_acquire) == 0) break;
+            else std::this_thread::yield();
+        }
+    });
+
+    bool once = true;
+    for (size_t i = 0; i < traced.size(); i++) once &= traced[i].load() == 1;
+    check(once, "RayStream: every ray traced once", workers);
+    check(exclusive, "RayStream: chunks held by one worker", workers);
+    uint32_t c, free_count = 0;
+    while (stream.free_chunks.pop(c)) free_count++;
+    check(free_count == pool && !stream.full_chunks.pop(c), "RayStream: whole pool free at the end", workers);
+}
+
+// Workers cycle chunks through the pool as fast as they can, for long enough that a worker gets preempted in the
+// middle of a pop while the others lap it. Chunks must neither get lost nor be handed out twice
+void stream_churn(int workers, long cycles, size_t pool) {
+    RayStream stream(pool);
+    std::vector<std::atomic<uint8_t>> held(pool);
+    std::atomic<bool> exclusive{true};
+
+    run_threads(workers, [&](int) {
+        for (long k = 0; k < cycles / workers; k++) {
+            int c = stream.acquire();
+            if (c >= 0) {
+                if (held[c].exchange(1)) exclusive = false;
+                stream.chunks[c].size = 1;
+                held[c] = 0;
+                stream.submit(c);
+            }
+            uint32_t full;
+            if (stream.full_chunks.pop(full)) {
+                if (held[full].exchange(1)) exclusive = false;
+                held[full] = 0;
+                stream.release(int(full));
+            }
+        }
+    });
+
+    uint32_t c;
+    while (stream.full_chunks.pop(c)) stream.release(int(c));
+    std::vector<int> count(pool);
+    while (stream.free_chunks.pop(c)) count[c]++;
+    check(exclusive && std::count(count.begin(), count.end(), 1) == long(pool) && stream.pending == 0,
+          "RayStream: pool intact after churn", workers);
+}
+
+int main() {
+    for (int threads : {2, 4, 8, 16, 64}) {
+        queue_stress(threads / 2, threads / 2, 100000 / threads, 16);
+        queue_stress(threads - 1, 1, 100000 / threads, 16);
+        queue_stress(1, threads - 1, 100000 / threads, 16);
+    }
+    for (int threads : {1, 2, 4, 8, 16, 64}) {
+        stream_stress(threads, 20000, 3, 8);   // pool small enough to run out
+        stream_stress(threads, 20000, 3, 256);
+    }
+    for (int threads : {2, 8, 64}) stream_churn(threads, 1 << 21, 4);
+    return failures ? 1 : 0;
+}
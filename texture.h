@@ -0,0 +1,328 @@
+#ifndef __TEXTURE_H__
+#define __TEXTURE_H__
+#include <vector>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include "geometry.h"
+#include "hugepage.h"
+
+// Image with its mip chain. Every level is stored in tiles of tile x tile texels, row-major over the tiles and
+// in Morton order inside a tile, so a bilinear footprint and its neighbours share one or two cache lines however
+// the lookups walk the image. Levels are padded up to whole tiles, the padding repeats the edge texels
+template <typename T> struct MipImage {
+    static constexpr int tile_log2 = 3, tile = 1 << tile_log2; // 8 x 8 texels
+
+    struct Level {
+        int width, height;
+        int tiles_x;
+        size_t offset; // of the first tile in texels
+    };
+    std::vector<Level> levels; // levels[0] is the finest one kept, see drop_finest()
+    HugeVector<T> texels;
+    int dropped = 0;           // finer levels released to fit a memory budget
+
+    // image is row-major, width x height. Each level halves the previous one (rounding down) with a box filter
+    void build(const std::vector<T>& image, int width, int height) {
+        levels.clear();
+        texels.clear();
+        dropped = 0;
+        if (width <= 0 || height <= 0) return;
+        std::vector<T> level = image, next;
+        size_t offset = 0;
+        for (int w = width, h = height;; ) {
+            Level l;
+            l.width = w;
+            l.height = h;
+            l.tiles_x = (w + tile - 1) / tile;
+            l.offset = offset;
+            levels.push_back(l);
+            offset += size_t(l.tiles_x) * ((h + tile - 1) / tile) * tile * tile;
+            if (w == 1 && h == 1) break;
+            w = std::max(1, w / 2);
+            h = std::max(1, h / 2);
+        }
+        texels.resize(offset);
+        for (size_t n = 0; n < levels.size(); n++) {
+            const Level& l = levels[n];
+            const int rows = (l.height + tile - 1) / tile * tile;
+            #pragma omp parallel for
+            for (int y = 0; y < rows; y++)
+                for (int x = 0; x < l.tiles_x * tile; x++) texels[address(l, x, y)] = level[std::min(y, l.height - 1) * size_t(l.width) + std::min(x, l.width - 1)];
+            if (n + 1 == levels.size()) break;
+            const Level& d = levels[n + 1];
+            next.assign(size_t(d.width) * d.height, T());
+            #pragma omp parallel for
+            for (int y = 0; y < d.height; y++) {
+                for (int x = 0; x < d.width; x++) {
+                    const int x0 = std::min(2 * x, l.width - 1), x1 = std::min(2 * x + 1, l.width - 1);
+                    const int y0 = std::min(2 * y, l.height - 1), y1 = std::min(2 * y + 1, l.height - 1);
+                    next[y * size_t(d.width) + x] = (level[y0 * size_t(l.width) + x0] + level[y0 * size_t(l.width) + x1] +
+                                                     level[y1 * size_t(l.width) + x0] + level[y1 * size_t(l.width) + x1]) * .25f;
+                }
+            }
+            level.swap(next);
+        }
+    }
+
+    bool empty() const { return levels.empty(); }
+    size_t bytes() const { return texels.capacity() * sizeof(T); } // allocated, what a memory budget is charged
+
+    // Level whose texels are about footprint wide, footprint being measured in texels of the full resolution
+    // image (dropped levels included): log2 rounded from the float exponent, clamped to the levels kept
+    int level(float footprint) const {
+        footprint *= 1.41421356f;
+        uint32_t bits;
+        std::memcpy(&bits, &footprint, sizeof(bits));
+        return std::min(int(levels.size()) - 1, std::max(0, int(bits >> 23) - 127 - dropped)); // footprint >= 0
+    }
+
+    // Releases the finest level, lookups of it get the next one instead. Keeps at least one level. The coarser ones
+    // are copied into an allocation of their own size, erasing would keep the old one
+    void drop_finest() {
+        if (levels.size() < 2) return;
+        const size_t first = levels[1].offset;
+        HugeVector<T> coarser(texels.begin() + first, texels.end());
+        texels.swap(coarser);
+        levels.erase(levels.begin());
+        for (Level& l : levels) l.offset -= first;
+        dropped++;
+    }
+
+    // x and y must lie in the level
+    const T& texel(int level, int x, int y) const { return texels[address(levels[level], x, y)]; }
+
+    // Bilinear sample at (u, v) in [0, 1], u wraps around when wrap_u and is clamped otherwise, v is clamped
+    T bilinear(int level, float u, float v, bool wrap_u) const {
+        const Level& l = levels[level];
+        float fx = u * l.width - .5f, fy = v * l.height - .5f;
+        int x0 = int(fx + 1) - 1, y0 = int(fy + 1) - 1; // floor without a libm call, fx and fy are above -1
+        float ax = fx - x0, ay = fy - y0;
+        int x1 = x0 + 1, y1 = y0 + 1;
+        if (wrap_u) { // u in [0, 1] puts x0 in [-1, width - 1]
+            x0 = x0 < 0 ? x0 + l.width : x0 >= l.width ? x0 - l.width : x0;
+            x1 = x1 >= l.width ? x1 - l.width : x1 < 0 ? x1 + l.width : x1;
+        }
+        else {
+            x0 = std::min(std::max(x0, 0), l.width - 1);
+            x1 = std::min(std::max(x1, 0), l.width - 1);
+        }
+        y0 = std::min(std::max(y0, 0), l.height - 1);
+        y1 = std::min(std::max(y1, 0), l.height - 1);
+        const T* base = &texels[l.offset];
+        const T& a = base[tiled(l, x0, y0)], &b = base[tiled(l, x1, y0)];
+        const T& c = base[tiled(l, x0, y1)], &d = base[tiled(l, x1, y1)];
+        return a * ((1 - ax) * (1 - ay)) + b * (ax * (1 - ay)) + c * ((1 - ax) * ay) + d * (ax * ay);
+    }
+
+private:
+    // Morton index of (x, y) inside a tile, bits interleaved as yxyxyx
+    static uint32_t morton2(uint32_t x, uint32_t y) {
+        auto spread = [](uint32_t v) {
+            v = (v | v << 2) & 0x33;
+            v = (v | v << 1) & 0x55;
+            return v;
+        };
+        return spread(x) | spread(y) << 1;
+    }
+
+    static size_t tiled(const Level& l, int x, int y) {
+        const size_t t = size_t(y >> tile_log2) * l.tiles_x + (x >> tile_log2);
+        return t << (2 * tile_log2) | morton2(x & (tile - 1), y & (tile - 1));
+    }
+
+    static size_t address(const Level& l, int x, int y) { return l.offset + tiled(l, x, y); }
+};
+
+// Radiance RGBE (.hdr) reader: flat and new-style run-length encoded scanlines, -Y H +X W orientation only
+inline bool load_hdr(const std::string& path, std::vector<Vec3f>& image, int& width, int& height) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    std::string line;
+    if (!std::getline(in, line) || line.compare(0, 2, "#?") != 0) return false;
+    while (std::getline(in, line) && !line.empty()) {
+        if (line.compare(0, 7, "FORMAT=") == 0 && line != "FORMAT=32-bit_rle_rgbe") return false;
+    }
+    if (!std::getline(in, line) || std::sscanf(line.c_str(), "-Y %d +X %d", &height, &width) != 2 || width <= 0 || height <= 0) return false;
+
+    image.assign(size_t(width) * height, Vec3f(0, 0, 0));
+    std::vector<unsigned char> scanline(size_t(width) * 4);
+    for (int y = 0; y < height; y++) {
+        unsigned char head[4];
+        if (!in.read(reinterpret_cast<char*>(head), 4)) return false;
+        if (width >= 8 && width < 32768 && head[0] == 2 && head[1] == 2 && (head[2] << 8 | head[3]) == width) {
+            // Run-length encoded, one channel after the other
+            for (int c = 0; c < 4; c++) {
+                for (int x = 0; x < width;) {
+                    int count = in.get();
+                    if (count == EOF) return false;
+                    if (count > 128) {
+                        count -= 128;
+                        int value = in.get();
+                        if (value == EOF || x + count > width) return false;
+                        for (; count--; x++) scanline[x * 4 + c] = (unsigned char)value;
+                    }
+                    else {
+                        if (count == 0 || x + count > width) return false;
+                        for (; count--; x++) {
+                            int value = in.get();
+                            if (value == EOF) return false;
+                            scanline[x * 4 + c] = (unsigned char)value;
+                        }
+                    }
+                }
+            }
+        }
+        else { // flat pixels, the four bytes just read are the first one
+            std::memcpy(scanline.data(), head, 4);
+            if (!in.read(reinterpret_cast<char*>(scanline.data() + 4), std::streamsize(width - 1) * 4)) return false;
+        }
+        for (int x = 0; x < width; x++) {
+            const unsigned char* p = &scanline[x * 4];
+            float f = p[3] ? std::ldexp(1.f, int(p[3]) - (128 + 8)) : 0.f;
+            image[size_t(y) * width + x] = Vec3f((p[0] + .5f) * f, (p[1] + .5f) * f, (p[2] + .5f) * f);
+        }
+    }
+    return true;
+}
+
+// Binary PPM (P6, 8 bits per channel) reader, values scaled to [0, 1]
+inline bool load_ppm(const std::string& path, std::vector<Vec3f>& image, int& width, int& height) {
+    std::ifstream in(path, std::ios::binary);
+    std::string magic;
+    int max_value = 0;
+    if (!(in >> magic) || magic != "P6") return false;
+    auto field = [&in](int& value) { // skips whitespace and # comments
+        for (int c; (c = in.peek()) != EOF && (std::isspace(c) || c == '#');) {
+            if (c == '#') in.ignore(1 << 20, '\n');
+            else in.get();
+        }
+        return bool(in >> value);
+    };
+    if (!field(width) || !field(height) || !field(max_value) || width <= 0 || height <= 0 || max_value != 255) return false;
+    in.get();
+    std::vector<unsigned char> bytes(size_t(width) * height * 3);
+    if (!in.read(reinterpret_cast<char*>(bytes.data()), std::streamsize(bytes.size()))) return false;
+    image.resize(size_t(width) * height);
+    for (size_t i = 0; i < image.size(); i++) image[i] = Vec3f(bytes[3 * i], bytes[3 * i + 1], bytes[3 * i + 2]) * (1.f / 255);
+    return true;
+}
+
+// .hdr or .ppm, by extension
+inline bool load_image(const std::string& path, std::vector<Vec3f>& image, int& width, int& height) {
+    if (path.size() >= 4 && path.compare(path.size() - 4, 4, ".hdr") == 0) return load_hdr(path, image, width, height);
+    return load_ppm(path, image, width, height);
+}
+
+// Textures by path, loaded once and shared by every material naming them. The mip chains stay within budget
+// bytes: while they don't fit, the finest level of the largest texture is released, so memory goes where the
+// resolution is highest and lookups of a trimmed texture clamp to the finest level left
+struct TextureCache {
+    size_t budget = size_t(256) << 20;
+
+    // Id of the texture at path, -1 when it can't be loaded
+    int load(const std::string& path) {
+        for (size_t i = 0; i < entries.size(); i++) if (entries[i].path == path) return int(i);
+        std::vector<Vec3f> pixels;
+        int w, h;
+        if (!load_image(path, pixels, w, h)) return -1;
+        entries.emplace_back();
+        entries.back().path = path;
+        entries.back().image.build(pixels, w, h);
+        fit();
+        return int(entries.size() - 1);
+    }
+
+    // Bilinear lookup at (u, v), u wrapping around, on the level matching footprint (in texels of the full image)
+    Vec3f lookup(int id, float u, float v, float footprint) const {
+        const MipImage<Vec3f>& image = entries[id].image;
+        return image.bilinear(image.level(footprint), u, v, true);
+    }
+
+    // Texels per unit of u at full resolution
+    int width(int id) const { return entries[id].image.levels[0].width << entries[id].image.dropped; }
+
+    size_t bytes() const {
+        size_t sum = 0;
+        for (const Entry& e : entries) sum += e.image.bytes();
+        return sum;
+    }
+
+    void fit() {
+        while (bytes() > budget) {
+            Entry* largest = nullptr;
+            for (Entry& e : entries) if (e.image.levels.size() > 1 && (!largest || e.image.bytes() > largest->image.bytes())) largest = &e;
+            if (!largest) break;
+            largest->image.drop_finest();
+        }
+    }
+
+private:
+    struct Entry {
+        std::string path;
+        MipImage<Vec3f> image;
+    };
+    std::vector<Entry> entries;
+};
+
+// Environment around the scene, loaded from an equirectangular image (u follows the azimuth around +y, v runs
+// from +y down to -y) and resampled once into an octahedral map: the direction is projected onto the octahedron
+// |x| + |y| + |z| = 1 and the lower half folded out over the corners, so finding the texel takes an abs, a divide
+// and a fold instead of atan2 and acos. Lookups pick the mip level matching the angular footprint of the ray and
+// filter bilinearly within it, a handful of loads from one or two tiles
+struct EnvironmentMap {
+    MipImage<Vec3f> image; // octahedral, size x size
+
+    bool load(const std::string& path) {
+        std::vector<Vec3f> pixels;
+        int w, h;
+        if (!load_hdr(path, pixels, w, h)) return false;
+        MipImage<Vec3f> equirect;
+        equirect.build(pixels, w, h);
+
+        // About as many texels as the source
+        const int size = std::max(MipImage<Vec3f>::tile, int(std::sqrt(double(w) * h)) / MipImage<Vec3f>::tile * MipImage<Vec3f>::tile);
+        std::vector<Vec3f> octahedral(size_t(size) * size);
+        #pragma omp parallel for
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                Vec3f dir = direction((x + .5f) / size, (y + .5f) / size);
+                float u = .5f + atan2f(dir.z, dir.x) * (.5f / 3.14159265f), v = acosf(std::max(-1.f, std::min(1.f, dir.y))) * (1.f / 3.14159265f);
+                octahedral[size_t(y) * size + x] = equirect.bilinear(0, u, v, true);
+            }
+        }
+        image.build(octahedral, size, size);
+        return true;
+    }
+
+    // Radiance arriving along -dir, dir normalized. footprint is the angle the ray covers in radians
+    Vec3f lookup(const Vec3f& dir, float footprint) const {
+        const float inv = 1 / (std::fabs(dir.x) + std::fabs(dir.y) + std::fabs(dir.z));
+        float px = dir.x * inv, pz = dir.z * inv;
+        if (dir.y < 0) {
+            const float fx = (1 - std::fabs(pz)) * (px < 0 ? -1.f : 1.f), fz = (1 - std::fabs(px)) * (pz < 0 ? -1.f : 1.f);
+            px = fx;
+            pz = fz;
+        }
+        // A texel of level 0 covers about 4 pi / size^2 steradians, sqrt(4 pi) / size radians across
+        return image.bilinear(image.level(footprint * image.levels[0].width * (1 / 3.5449077f)), px * .5f + .5f, pz * .5f + .5f, false);
+    }
+
+    // Inverse of the octahedral mapping, (u, v) in [0, 1]
+    static Vec3f direction(float u, float v) {
+        float x = 2 * u - 1, z = 2 * v - 1, y = 1 - std::fabs(x) - std::fabs(z);
+        if (y < 0) {
+            const float fx = (1 - std::fabs(z)) * (x < 0 ? -1.f : 1.f), fz = (1 - std::fabs(x)) * (z < 0 ? -1.f : 1.f);
+            x = fx;
+            z = fz;
+        }
+        return Vec3f(x, y, z).normalize();
+    }
+};
+
+#endif //__TEXTURE_H__
@@ -4,40 +4,87 @@
 #include <string>
 #include <fstream>
 #include <vector>
+#include <array>
+#include <cstring>
+#include <cstdlib>
+#include <charconv>
+#include <chrono>
+#include <algorithm>
 #include "geometry.h"
+#include "grid.h"
+#include "bvh.h"
+#include "irradiance.h"
+#include "numa.h"
+#include "instrument.h"
+#include "rayqueue.h"
+#include "interleave.h"
+#include "outofcore.h"
+#include "lod.h"
+#include "texture.h"
+#include "gbuffer.h"
+#include "denoise.h"
+#include "upscale.h"
+#ifdef TINYRT_HEADLESS
+#include "headless.h"
+#else
 #include "raylib.h"
+#endif
 
 const int width = 1024;
 const int height = 768;
 const int fov = 3.14159265 / 2;
 
+enum LightShape { LIGHT_POINT, LIGHT_SPHERE, LIGHT_RECT };
+
+// A point light, or an area light casting soft shadows: a sphere of radius r around p, or a rectangle centered on p
+// spanned by the edges u and v. Shading takes the light from its center, only the shadows are sampled over the area
 struct Light {
-    Light(const Vec3f& p, const float& i) : position(p), intensity(i) {}
+    constexpr Light(const Vec3f& p, const float& i) : position(p), intensity(i) {}
+    constexpr Light(const Vec3f& p, const float& r, const float& i) : shape(LIGHT_SPHERE), position(p), intensity(i), radius(r) {}
+    constexpr Light(const Vec3f& p, const Vec3f& u, const Vec3f& v, const float& i) : shape(LIGHT_RECT), position(p), intensity(i), edge_u(u), edge_v(v) {}
+    LightShape shape = LIGHT_POINT;
     Vec3f position;
     float intensity;
+    float radius = 0;
+    Vec3f edge_u, edge_v;
 };
 
 struct MMaterial {
-    MMaterial(const float& r, const Vec4f& a, const Vec3f& color, const float& spec) : refractive_index(r), albedo(a), diffuse_color(color), specular_exponent(spec) {}
-    MMaterial() : refractive_index(1), albedo(1, 0, 0, 0), diffuse_color(), specular_exponent() {}
+    constexpr MMaterial(const float& r, const Vec4f& a, const Vec3f& color, const float& spec) : refractive_index(r), albedo(a), diffuse_color(color), specular_exponent(spec) {}
+    constexpr MMaterial() : refractive_index(1), albedo(1, 0, 0, 0), diffuse_color(), specular_exponent() {}
     float refractive_index;
     Vec4f albedo;
     Vec3f diffuse_color;
     float specular_exponent;
+    int16_t diffuse_map = -1;  // ids in Scene::textures, -1 for none: replaces diffuse_color,
+    int16_t specular_map = -1; // scales the specular albedo by its red channel,
+    int16_t normal_map = -1;   // and perturbs the normal in the tangent frame of the sphere's uv mapping
 };
 
+// What ray_intersect() reads comes first, in 16 bytes, so a candidate test touches one cache line or two
 struct Sphere {
     Vec3f center;
+    float radius2;    // radius * radius
+    float inv_radius; // 1 / radius, scales hit - center into the unit normal
     float radius;
+    Vec3f bmin, bmax; // axis aligned bounds, kept in sync by set_center()
     MMaterial material;
 
-    Sphere(const Vec3f& c, const float& r, const MMaterial& m) : center(c), radius(r), material(m) {}
+    constexpr Sphere(const Vec3f& c, const float& r, const MMaterial& m) : center(c), radius2(r * r), inv_radius(1 / r), radius(r),
+        bmin(c.x - r, c.y - r, c.z - r), bmax(c.x + r, c.y + r, c.z + r), material(m) {}
+
+    void set_center(const Vec3f& c) {
+        center = c;
+        bmin = Vec3f(c.x - radius, c.y - radius, c.z - radius);
+        bmax = Vec3f(c.x + radius, c.y + radius, c.z + radius);
+    }
+
+    Vec3f normal(const Vec3f& hit) const { return (hit - center) * inv_radius; }
 
     bool ray_intersect(const Vec3f& orig, const Vec3f& dir, float& t0) const {
         Vec3f L = center - orig; // Vector orig to center
         float tca = L * dir; // Projection center to ray
         float d2 = L * L - tca * tca; // Squared distance center to tca
-        float radius2 = radius * radius;
         if (d2 > radius2) return false; // If squared distance > squared radius then no intersect
         float thc = sqrtf(radius2 - d2); // tca to intersection distance
         t0 = tca - thc;
@@ -48,10 +95,65 @@ struct Sphere {
     }
 };
 
+enum Accel { ACCEL_LINEAR, ACCEL_GRID, ACCEL_BVH, ACCEL_BVH4, ACCEL_BVH8, ACCEL_COUNT };
+const char* const accel_names[ACCEL_COUNT] = {"linear", "grid", "bvh", "bvh4", "bvh8"};
+
+// Runtime scene: spheres move every frame, so commit() rebuilds the selected acceleration structure after edits
+struct Scene {
+    HugeVector<Sphere> spheres;
+    std::vector<Light> lights;
+    Accel accel = ACCEL_LINEAR;
+    BVHBuilder bvh_builder = BVH_HYBRID;
+    UniformGrid grid;
+    BVH bvh;
+    WideBVH<4> bvh4; // collapsed from bvh
+    WideBVH<8> bvh8;
+    bool interleave = false; // streaming only: chunks traverse the binary BVH as interleaved coroutines
+    int prefetch_linear = 32; // software prefetch distances: spheres ahead in the linear loop
+    int prefetch_tree = 0;    // and stack entries ahead in BVH traversal
+    float lod_pixels = 0; // BVH only: clusters smaller than this many pixels are traced as one proxy sphere, 0 disables
+    float pixel_size = 0; // of a pixel at unit distance from the camera, for the current scale
+    LODProxies<Sphere> lod;
+    bool use_irradiance_cache = false;
+    mutable IrradianceCache irradiance; // direct diffuse lighting and shadows, only valid until the next commit()
+    std::shared_ptr<const BrickedScene<Sphere>> field; // static out-of-core spheres, their ids follow those of spheres
+    std::shared_ptr<const EnvironmentMap> environment; // background, the constant sky color when null
+    std::shared_ptr<const TextureCache> textures;      // the maps materials refer to
+    uint64_t version = 0; // counts commits, node replicas are copied again only when it moves on
+
+    void commit() {
+        version++;
+        if (use_irradiance_cache) irradiance.clear();
+        if (accel == ACCEL_GRID) grid.build(spheres);
+        if (accel == ACCEL_BVH || accel == ACCEL_BVH4 || accel == ACCEL_BVH8) bvh.build(spheres, bvh_builder);
+        if (accel == ACCEL_BVH && lod_pixels > 0) lod.build(bvh, spheres, Vec3f(0, 0, 0), lod_pixels * pixel_size); // the camera sits at the origin
+        if (accel == ACCEL_BVH4) bvh4.build(bvh);
+        if (accel == ACCEL_BVH8) bvh8.build(bvh);
+        bvh.prefetch_distance = bvh4.prefetch_distance = bvh8.prefetch_distance = prefetch_tree;
+    }
+};
+
+// Scene whose primitive and light counts are fixed at compile time (kiosk builds), always traversed linearly
+template <size_t NSpheres, size_t NLights> struct FixedScene {
+    std::array<Sphere, NSpheres> spheres;
+    std::array<Light, NLights> lights;
+    uint64_t version = 0; // as in Scene
+
+    void commit() { version++; }
+};
+
 Vec3f reflect(const Vec3f& I, const Vec3f& N) {
     return I - N * 2.f * (I * N);
 }
 
+float specular_pow(const float& x, const float& exponent) {
+#ifdef TINYRT_FAST_MATH
+    return fast_pow(x, exponent);
+#else
+    return powf(x, exponent);
+#endif
+}
+
 Vec3f refract(const Vec3f& I, const Vec3f& N, const float& refractive_index) { // Snell's law
     float cosi = -std::max(-1.f, std::min(1.f, I * N));
     float etai = 1, etat = refractive_index;
@@ -65,77 +167,690 @@ Vec3f refract(const Vec3f& I, const Vec3f& N, const float& refractive_index) { /
     return k < 0 ? Vec3f(0, 0, 0) : I * eta + n * (eta * cosi - sqrtf(k));
 }
 
-bool scene_intersect(const Vec3f& orig, const Vec3f& dir, const std::vector<Sphere>& spheres, Vec3f& hit, Vec3f& N, MMaterial& material) {
-    float spheres_dist = std::numeric_limits<float>::max();
+// Primitive ids returned by scene_intersect(): spheres are indexed by their position in the array
+const int NO_HIT = -1;
+const int CHECKERBOARD_ID = -2; // the checkerboard plane is not stored in the sphere array
+const int LOD_PROXY_ID = -3;    // and down: the proxy sphere of BVH node LOD_PROXY_ID - id
+
+// Everything shading needs about a hit, built once for the closest primitive by surface_interaction()
+struct SurfaceInteraction {
+    Vec3f point;
+    Vec3f N;
+    Vec2f uv;
+    MMaterial material;
+    float curvature; // 1 / radius, 0 for the plane
+};
+
+// Spheres is any random access container, a std::array gives the compiler a fixed primitive count.
+// prefetch_distance is how many spheres ahead of the one being tested are prefetched, 0 disables
+template <typename Spheres> void intersect_linear(const Vec3f& orig, const Vec3f& dir, const Spheres& spheres, float& t, int& prim, int ignore, int prefetch_distance = 0) {
+    t = std::numeric_limits<float>::max();
+    prim = NO_HIT;
     for (size_t i = 0; i < spheres.size(); i++) {
+        if (prefetch_distance && i + prefetch_distance < spheres.size()) { // center and radius2 may straddle two lines
+            prefetch(&spheres[i + prefetch_distance].center);
+            prefetch(&spheres[i + prefetch_distance].radius2);
+        }
         float dist_i;
-        if (spheres[i].ray_intersect(orig, dir, dist_i) && dist_i < spheres_dist) {
-            spheres_dist = dist_i;
-            hit = orig + dir * dist_i;
-            N = (hit - spheres[i].center).normalize();
-            material = spheres[i].material;
+        if (int(i) != ignore && spheres[i].ray_intersect(orig, dir, dist_i) && dist_i < t) {
+            t = dist_i;
+            prim = int(i);
         }
     }
+}
 
-    float checkerboard_dist = std::numeric_limits<float>::max();
-    if (fabs(dir.y) > 1e-3) {
+template <typename SceneT> void intersect_spheres(const Vec3f& orig, const Vec3f& dir, const SceneT& scene, float& t, int& prim, int ignore) {
+    intersect_linear(orig, dir, scene.spheres, t, prim, ignore);
+}
+
+// The animated spheres, through the selected acceleration structure
+void intersect_accel(const Vec3f& orig, const Vec3f& dir, const Scene& scene, float& t, int& prim, int ignore) {
+    switch (scene.accel) {
+        case ACCEL_GRID: scene.grid.intersect(orig, dir, scene.spheres, t, prim, ignore); break;
+        case ACCEL_BVH:
+            if (scene.lod_pixels > 0) scene.lod.intersect(scene.bvh, orig, dir, scene.spheres, t, prim, ignore, LOD_PROXY_ID);
+            else scene.bvh.intersect(orig, dir, scene.spheres, t, prim, ignore);
+            break;
+        case ACCEL_BVH4: scene.bvh4.intersect(orig, dir, scene.spheres, t, prim, ignore); break;
+        case ACCEL_BVH8: scene.bvh8.intersect(orig, dir, scene.spheres, t, prim, ignore); break;
+        default:         intersect_linear(orig, dir, scene.spheres, t, prim, ignore, scene.prefetch_linear); break;
+    }
+}
+
+void intersect_spheres(const Vec3f& orig, const Vec3f& dir, const Scene& scene, float& t, int& prim, int ignore) {
+    intersect_accel(orig, dir, scene, t, prim, ignore);
+    if (scene.field) {
+        const int offset = int(scene.spheres.size());
+        float tf;
+        int64_t pf;
+        if (scene.field->intersect(orig, dir, tf, pf, ignore >= offset ? ignore - offset : -1) && tf < t) {
+            t = tf;
+            prim = offset + int(pf); // main() only opens fields whose ids fit
+        }
+    }
+}
+
+// Sphere hits for a whole chunk of rays, which lets the BVH interleave their traversals
+template <typename SceneT> void intersect_spheres(const RayChunk& chunk, const SceneT& scene, float* t, int* prim) {
+    for (int k = 0; k < chunk.size; k++) {
+        QueuedRay ray = chunk[k];
+        intersect_spheres(ray.orig, ray.dir, scene, t[k], prim[k], ray.ignore);
+    }
+}
+
+void intersect_spheres(const RayChunk& chunk, const Scene& scene, float* t, int* prim) {
+    Vec3f orig[RayChunk::capacity], dir[RayChunk::capacity];
+    for (int k = 0; k < chunk.size; k++) {
+        orig[k] = Vec3f(chunk.ox[k], chunk.oy[k], chunk.oz[k]);
+        dir[k] = Vec3f(chunk.dx[k], chunk.dy[k], chunk.dz[k]);
+    }
+    if (scene.accel == ACCEL_BVH && scene.interleave && scene.lod_pixels <= 0) intersect_interleaved(scene.bvh, orig, dir, chunk.ignore, chunk.size, scene.spheres, t, prim);
+    else for (int k = 0; k < chunk.size; k++) intersect_accel(orig[k], dir[k], scene, t[k], prim[k], chunk.ignore[k]);
+    if (scene.field) { // traced for the whole chunk at once, so that its rays share brick loads
+        const int offset = int(scene.spheres.size());
+        int64_t ignore[RayChunk::capacity], pf[RayChunk::capacity];
+        float tf[RayChunk::capacity];
+        for (int k = 0; k < chunk.size; k++) ignore[k] = chunk.ignore[k] >= offset ? chunk.ignore[k] - offset : -1;
+        scene.field->intersect(orig, dir, ignore, chunk.size, tf, pf);
+        for (int k = 0; k < chunk.size; k++) {
+            if (pf[k] >= 0 && tf[k] < t[k]) {
+                t[k] = tf[k];
+                prim[k] = offset + int(pf[k]);
+            }
+        }
+    }
+}
+
+template <typename SceneT> IrradianceCache* irradiance_cache(const SceneT&) {
+    return nullptr;
+}
+
+IrradianceCache* irradiance_cache(const Scene& scene) {
+    return scene.use_irradiance_cache ? &scene.irradiance : nullptr;
+}
+
+// Radiance of rays leaving the scene along dir
+template <typename SceneT> Vec3f background(const Vec3f&, const RayCone&, const SceneT&) {
+    return Vec3f(0.2, 0.7, 0.8);
+}
+
+Vec3f background(const Vec3f& dir, const RayCone& cone, const Scene& scene) {
+    return scene.environment ? scene.environment->lookup(dir, cone.spread) : Vec3f(0.2, 0.7, 0.8);
+}
+
+void intersect_plane(const Vec3f& orig, const Vec3f& dir, float& t, int& prim, int ignore) {
+    if (ignore != CHECKERBOARD_ID && fabs(dir.y) > 1e-3) {
         float d = -(orig.y + 4) / dir.y; // the checkerboard plane has equation y = -4
-        Vec3f pt = orig + dir * d;
-        if (d > 0 && fabs(pt.x) < 10 && pt.z<-10 && pt.z>-30 && d < spheres_dist) {
-            checkerboard_dist = d;
-            hit = pt;
-            N = Vec3f(0, 1, 0);
-            material.diffuse_color = (int(.5 * hit.x + 1000) + int(.5 * hit.z)) & 1 ? Vec3f(1, 1, 1) : Vec3f(1, .7, .3);
-            material.diffuse_color = material.diffuse_color * .3;
+        float x = orig.x + dir.x * d, z = orig.z + dir.z * d;
+        if (d > 0 && fabs(x) < 10 && z<-10 && z>-30 && d < t) {
+            t = d;
+            prim = CHECKERBOARD_ID;
         }
     }
-    return std::min(spheres_dist, checkerboard_dist) < 1000;
 }
 
-Vec3f cast_ray(const Vec3f& orig, const Vec3f& dir, const std::vector<Sphere>& spheres, const std::vector<Light>& lights, size_t depth, int maxDepth) {
-    Vec3f point, N;
-    MMaterial material;
+// Lean traversal: only the closest distance and primitive id are tracked, nothing is reconstructed per candidate.
+// The ignore primitive is skipped, secondary rays use it to exclude the surface they leave (see spawn_ray())
+template <typename SceneT> bool scene_intersect(const Vec3f& orig, const Vec3f& dir, const SceneT& scene, float& t, int& prim, int ignore = NO_HIT) {
+    intersect_spheres(orig, dir, scene, t, prim, ignore);
+    intersect_plane(orig, dir, t, prim, ignore);
+    return t < 1000;
+}
+
+// scene_intersect() over a chunk, a ray hit something when its t is below 1000. Timed as a whole, unlike the
+// single ray version, whose calls are too short to sample counters around
+template <typename SceneT> void scene_intersect(const RayChunk& chunk, const SceneT& scene, float* t, int* prim) {
+    PerfScope scope(STAGE_INTERSECT);
+    intersect_spheres(chunk, scene, t, prim);
+    for (int k = 0; k < chunk.size; k++) intersect_plane(Vec3f(chunk.ox[k], chunk.oy[k], chunk.oz[k]), Vec3f(chunk.dx[k], chunk.dy[k], chunk.dz[k]), t[k], prim[k], chunk.ignore[k]);
+}
+
+template <typename SceneT> const Sphere& scene_sphere(const SceneT& scene, int prim) {
+    return scene.spheres[prim];
+}
+
+const Sphere& scene_sphere(const Scene& scene, int prim) {
+    if (prim <= LOD_PROXY_ID) return scene.lod.proxies[LOD_PROXY_ID - prim];
+    return size_t(prim) < scene.spheres.size() ? scene.spheres[prim] : (*scene.field)[prim - scene.spheres.size()];
+}
+
+// Texture maps of a sphere hit's material, width is the ray cone's at the hit
+template <typename SceneT> void apply_textures(SurfaceInteraction&, const Sphere&, const Vec3f&, float, const SceneT&) {}
+
+void apply_textures(SurfaceInteraction& si, const Sphere& sphere, const Vec3f& dir, float width, const Scene& scene) {
+    const MMaterial& m = sphere.material;
+    if (!scene.textures || (m.diffuse_map < 0 && m.specular_map < 0 && m.normal_map < 0)) return;
+    const TextureCache& textures = *scene.textures;
+    // The cone footprint stretched by the incidence angle, in units of u (which spans 2 pi r around the equator)
+    const float footprint = width / (std::max(.1f, std::fabs(dir * si.N)) * 2 * 3.14159265f * sphere.radius);
+    if (m.diffuse_map >= 0) si.material.diffuse_color = textures.lookup(m.diffuse_map, si.uv.x, si.uv.y, footprint * textures.width(m.diffuse_map));
+    if (m.specular_map >= 0) si.material.albedo[1] *= textures.lookup(m.specular_map, si.uv.x, si.uv.y, footprint * textures.width(m.specular_map)).x;
+    if (m.normal_map >= 0) {
+        Vec3f T(-si.N.z, 0, si.N.x); // direction of growing u, undefined at the poles
+        if (T * T < 1e-12f) return;
+        T.normalize();
+        Vec3f B = cross(T, si.N);    // up the image, green is up in tangent space
+        Vec3f n = textures.lookup(m.normal_map, si.uv.x, si.uv.y, footprint * textures.width(m.normal_map)) * 2.f - Vec3f(1, 1, 1);
+        si.N = (T * n.x + B * n.y + si.N * n.z).normalize();
+    }
+}
+
+// cone is the ray's, for the texture level of detail
+template <typename SceneT> SurfaceInteraction surface_interaction(const Vec3f& orig, const Vec3f& dir, const float& t, const int& prim, const SceneT& scene, const RayCone& cone) {
+    SurfaceInteraction si;
+    si.point = orig + dir * t;
+    if (prim == CHECKERBOARD_ID) {
+        si.N = Vec3f(0, 1, 0);
+        si.uv = Vec2f(.5 * si.point.x, .5 * si.point.z); // one checker per unit of uv
+        si.material.diffuse_color = (int(.5 * si.point.x + 1000) + int(.5 * si.point.z)) & 1 ? Vec3f(1, 1, 1) : Vec3f(1, .7, .3);
+        si.material.diffuse_color = si.material.diffuse_color * .3;
+        si.curvature = 0;
+    }
+    else {
+        const Sphere& sphere = scene_sphere(scene, prim);
+        si.N = sphere.normal(si.point);
+#ifdef TINYRT_FAST_MATH
+        si.uv = Vec2f(.5f + fast_atan2(si.N.z, si.N.x) * (.5f / 3.14159265f), fast_acos(si.N.y) * (1.f / 3.14159265f)); // asin(y) = pi / 2 - acos(y)
+#else
+        si.uv = Vec2f(.5f + atan2f(si.N.z, si.N.x) * (.5f / 3.14159265f), .5f - asinf(std::max(-1.f, std::min(1.f, si.N.y))) * (1.f / 3.14159265f));
+#endif
+        si.material = sphere.material;
+        si.curvature = sphere.inv_radius;
+        apply_textures(si, sphere, dir, cone.width_at(t), scene);
+    }
+    return si;
+}
 
-    if (depth > maxDepth || !scene_intersect(orig, dir, spheres, point, N, material)) {
-        return Vec3f(0.2, 0.7, 0.8); // background color
+// Robust origin for rays leaving a surface (Waechter & Binder, "A Fast and Robust Method for Avoiding
+// Self-Intersection"): p is pushed along n by a few ulps, so the offset scales with the magnitude of p
+Vec3f offset_ray(const Vec3f& p, const Vec3f& n) {
+    const float origin = 1.f / 32, float_scale = 1.f / 65536, int_scale = 256;
+    Vec3f ret;
+    for (size_t i = 0; i < 3; i++) {
+        int32_t bits, of = int32_t(int_scale * n[i]);
+        std::memcpy(&bits, &p[i], sizeof(bits));
+        bits += p[i] < 0 ? -of : of;
+        float pi;
+        std::memcpy(&pi, &bits, sizeof(pi));
+        ret[i] = std::fabs(p[i]) < origin ? p[i] + float_scale * n[i] : pi;
     }
+    return ret;
+}
+
+// Origin of a secondary ray leaving the surface of prim along dir, and the primitive it must not hit.
+// With TINYRT_ROBUST_OFFSETS a ray leaving a convex surface outwards just excludes it and starts exactly on it,
+// only rays going into a sphere (which must find its far side) are offset, by ulps instead of a world space epsilon
+void spawn_ray(const SurfaceInteraction& si, [[maybe_unused]] const int& prim, const Vec3f& dir, Vec3f& orig, int& ignore) {
+#ifdef TINYRT_ROBUST_OFFSETS
+    if (prim == CHECKERBOARD_ID || dir * si.N >= 0) {
+        orig = si.point;
+        ignore = prim;
+    }
+    else {
+        orig = offset_ray(si.point, -si.N);
+        ignore = NO_HIT;
+    }
+#else
+    orig = dir * si.N < 0 ? si.point - si.N * 1e-3 : si.point + si.N * 1e-3; // offset the original point to avoid occlusion by the object itself
+    ignore = NO_HIT;
+#endif
+}
 
-    Vec3f reflect_dir = reflect(dir, N).normalize();
-    Vec3f refract_dir = refract(dir, N, material.refractive_index).normalize();
-    Vec3f reflect_orig = reflect_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3; // offset the original point to avoid occlusion by the object itself
-    Vec3f refract_orig = refract_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3;
-    Vec3f reflect_color = cast_ray(reflect_orig, reflect_dir, spheres, lights, depth + 1, maxDepth);
-    Vec3f refract_color = cast_ray(refract_orig, refract_dir, spheres, lights, depth + 1, maxDepth);
+// Area lights are sampled on a grid of shadow_strata^2 cells, jittered per shading point. The first shadow_agree
+// samples are the corner cells: when they agree the point is taken as fully lit or fully shadowed and the rest is
+// skipped, so only penumbrae pay for every sample
+const int shadow_strata = 4, shadow_agree = 4;
+constexpr int shadow_order[shadow_strata * shadow_strata] = {0, 15, 3, 12, 5, 10, 6, 9, 1, 14, 2, 13, 4, 11, 7, 8};
 
+// Maps [0, 1)^2 onto the unit disk keeping strata compact (Shirley & Chiu, "A Low Distortion Map Between Disk and Square")
+Vec2f concentric_disk(float s, float t) {
+    const float x = 2 * s - 1, y = 2 * t - 1, quarter_pi = 3.14159265f / 4;
+    if (x == 0 && y == 0) return Vec2f(0, 0);
+    const float r = std::fabs(x) > std::fabs(y) ? x : y;
+    const float phi = std::fabs(x) > std::fabs(y) ? quarter_pi * (y / x) : 2 * quarter_pi - quarter_pi * (x / y);
+    return Vec2f(r * std::cos(phi), r * std::sin(phi));
+}
+
+// Fraction of light seen from a hit, light_dir and light_distance pointing at its center
+template <typename SceneT> float light_visibility(const SurfaceInteraction& si, const int& prim, const Light& light, const Vec3f& light_dir, const float& light_distance, const SceneT& scene) {
+    Vec3f shadow_orig; // checking if the point lies in the shadow of the light
+    float shadow_t;
+    int shadow_prim, shadow_ignore;
+    if (light.shape == LIGHT_POINT) {
+        spawn_ray(si, prim, light_dir, shadow_orig, shadow_ignore);
+        return scene_intersect(shadow_orig, light_dir, scene, shadow_t, shadow_prim, shadow_ignore) && shadow_t < light_distance ? 0.f : 1.f;
+    }
+
+    // A sphere is sampled over the disk it shows to the point, a rectangle over itself
+    Vec3f u = light.edge_u, v = light.edge_v;
+    if (light.shape == LIGHT_SPHERE) {
+        u = cross(light_dir, std::fabs(light_dir.x) > .9f ? Vec3f(0, 1, 0) : Vec3f(1, 0, 0)).normalize() * light.radius;
+        v = cross(light_dir, u);
+    }
+    uint32_t seed = 0; // jitter follows the point, so the noise is fixed on the surface rather than changing every frame
+    for (size_t i = 0; i < 3; i++) {
+        uint32_t bits;
+        std::memcpy(&bits, &si.point[i], sizeof(bits));
+        seed = (seed ^ bits) * 2654435761u;
+    }
+    auto random = [&seed]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) * (1.f / 16777216.f); }; // [0, 1)
+
+    const int samples = shadow_strata * shadow_strata;
+    int lit = 0;
+    for (int k = 0; k < samples; k++) {
+        if (k == shadow_agree && (lit == 0 || lit == k)) return lit ? 1.f : 0.f;
+        const float s = (shadow_order[k] % shadow_strata + random()) / shadow_strata, t = (shadow_order[k] / shadow_strata + random()) / shadow_strata;
+        Vec3f target = light.position;
+        if (light.shape == LIGHT_SPHERE) {
+            Vec2f d = concentric_disk(s, t);
+            target = target + u * d.x + v * d.y;
+        }
+        else target = target + u * (s - .5f) + v * (t - .5f);
+        Vec3f dir = target - si.point;
+        const float distance = dir.norm();
+        dir = dir * (1 / distance);
+        spawn_ray(si, prim, dir, shadow_orig, shadow_ignore);
+        if (!scene_intersect(shadow_orig, dir, scene, shadow_t, shadow_prim, shadow_ignore) || shadow_t >= distance) lit++;
+    }
+    return lit * (1.f / samples);
+}
+
+// Light arriving straight from the lights at a hit, diffuse and specular with shadows, scaled by the material albedo
+template <typename SceneT> Vec3f direct_lighting(const SurfaceInteraction& si, const int& prim, const Vec3f& dir, const SceneT& scene) {
+    const Vec3f& point = si.point;
+    const Vec3f& N = si.N;
+    const MMaterial& material = si.material;
+    const auto& lights = scene.lights;
     float diffuse_light_intensity = 0, specular_light_intensity = 0;
+
+    // Diffuse lighting and shadows change slowly across a surface, a cache hit skips every shadow ray
+    IrradianceCache* cache = lights.size() <= IrradianceCache::max_lights ? irradiance_cache(scene) : nullptr;
+    float visibility[IrradianceCache::max_lights];
+    bool cached = cache && cache->lookup(point, N, prim, int(lights.size()), diffuse_light_intensity, visibility);
+
     for (size_t i = 0; i < lights.size(); i++) {
         Vec3f light_dir = (lights[i].position - point).normalize();
+        if (cached) {
+            specular_light_intensity += visibility[i] * specular_pow(std::max(0.f, -reflect(-light_dir, N) * dir), material.specular_exponent) * lights[i].intensity;
+            continue;
+        }
         float light_distance = (lights[i].position - point).norm();
+        const float visible = light_visibility(si, prim, lights[i], light_dir, light_distance, scene);
+        if (cache) visibility[i] = visible;
+        if (visible == 0) continue;
 
-        Vec3f shadow_orig = light_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3; // checking if the point lies in the shadow of the lights[i]
-        Vec3f shadow_pt, shadow_N;
-        MMaterial tmpmaterial;
-        if (scene_intersect(shadow_orig, light_dir, spheres, shadow_pt, shadow_N, tmpmaterial) && (shadow_pt - shadow_orig).norm() < light_distance)
-            continue;
+        diffuse_light_intensity += visible * lights[i].intensity * std::max(0.f, light_dir * N);
+        specular_light_intensity += visible * specular_pow(std::max(0.f, -reflect(-light_dir, N) * dir), material.specular_exponent) * lights[i].intensity;
+    }
+    if (cache && !cached) cache->insert(point, N, prim, int(lights.size()), diffuse_light_intensity, visibility);
+    return material.diffuse_color * diffuse_light_intensity * material.albedo[0] + Vec3f(1., 1., 1.) * specular_light_intensity * material.albedo[1];
+}
+
+
+// Cone of the rays leaving a hit at distance t: it starts as wide as the incoming one got, and a convex surface
+// spreads it by twice the angle its normal turns across that width. Used for refraction too, which ignores focusing
+RayCone secondary_cone(const RayCone& cone, const float& t, const SurfaceInteraction& si) {
+    RayCone next;
+    next.width = cone.width_at(t);
+    next.spread = cone.spread + 2 * next.width * si.curvature;
+    return next;
+}
+
+// G-buffer record of a primary ray that hit prim at distance t
+PrimaryHit primary_hit(const float& t, const SurfaceInteraction& si, const int& prim) {
+    PrimaryHit hit;
+    hit.depth = t;
+    hit.N = si.N;
+    hit.albedo = si.material.diffuse_color;
+    hit.id = prim;
+    return hit;
+}
+
+// Depth is the number of bounces left, so the recursion is resolved at compile time and can be fully unrolled.
+// Reflect and Refract can be turned off for scenes known not to use them (see has_reflection() and has_refraction()).
+// Primary rays can pass hit to get what they found, for the G-buffer; secondary rays pass nullptr
+template <int Depth, bool Reflect, bool Refract, typename SceneT> Vec3f cast_ray(const Vec3f& orig, const Vec3f& dir, const SceneT& scene, int ignore, const RayCone& cone, PrimaryHit* hit) {
+    constexpr int Next = Depth < 0 ? -1 : Depth - 1; // cast_ray<-1> only returns the background, this just stops the instantiation chain
+    float t;
+    int prim;
+
+    if constexpr (Depth < 0) {
+        return background(dir, cone, scene);
+    }
+    else if (!scene_intersect(orig, dir, scene, t, prim, ignore)) {
+        if (hit) *hit = PrimaryHit();
+        return background(dir, cone, scene);
+    }
+
+    const SurfaceInteraction si = surface_interaction(orig, dir, t, prim, scene, cone);
+    const Vec3f& N = si.N;
+    const MMaterial& material = si.material;
+    if (hit) *hit = primary_hit(t, si, prim);
+    const RayCone next = secondary_cone(cone, t, si);
+
+    Vec3f reflect_color, refract_color; // rays with no weight are skipped, like trace_stream_ray() does
+    if (Reflect && material.albedo[2] != 0) {
+        Vec3f reflect_dir = reflect(dir, N).normalize();
+        Vec3f reflect_orig;
+        int reflect_ignore;
+        spawn_ray(si, prim, reflect_dir, reflect_orig, reflect_ignore);
+        reflect_color = cast_ray<Next, Reflect, Refract>(reflect_orig, reflect_dir, scene, reflect_ignore, next, nullptr);
+    }
+    if (Refract && material.albedo[3] != 0) {
+        Vec3f refract_dir = refract(dir, N, material.refractive_index).normalize();
+        Vec3f refract_orig;
+        int refract_ignore;
+        spawn_ray(si, prim, refract_dir, refract_orig, refract_ignore);
+        refract_color = cast_ray<Next, Reflect, Refract>(refract_orig, refract_dir, scene, refract_ignore, next, nullptr);
+    }
+
+    return direct_lighting(si, prim, dir, scene) + reflect_color * material.albedo[2] + refract_color * material.albedo[3];
+}
+
+template <typename SceneT> using TraceKernel = Vec3f (*)(const Vec3f&, const Vec3f&, const SceneT&, int, const RayCone&, PrimaryHit*);
+
+// Picks the specialized kernel once per frame, maxDepth is clamped to the range allowed by the key handlers
+template <bool Reflect, bool Refract, typename SceneT> TraceKernel<SceneT> trace_kernel(int maxDepth) {
+    switch (maxDepth) {
+        case 0:  return cast_ray<0, Reflect, Refract, SceneT>;
+        case 1:  return cast_ray<1, Reflect, Refract, SceneT>;
+        case 2:  return cast_ray<2, Reflect, Refract, SceneT>;
+        case 3:  return cast_ray<3, Reflect, Refract, SceneT>;
+        default: return cast_ray<4, Reflect, Refract, SceneT>;
+    }
+}
+
+// Render state kept across frames: the framebuffer in one stripe of rows per node, first touched by that node's
+// workers, and a scene replica on every node but the first so traversal reads local memory
+template <typename SceneT> struct RenderTarget {
+    NumaTopology topology = NumaTopology::detect();
+    std::vector<std::unique_ptr<SceneT>> replicas; // replicas[n - 1] is copied and read by the workers of node n
+    NumaBuffer<Vec3f> framebuffer;
+    TileScheduler tiles;
+    RayStream stream;       // ray chunks in flight, used when streaming
+    bool streaming = false; // trace through the ray queue instead of the recursive kernels
+    bool deterministic = false;  // pixel values independent of thread count and scheduling, see Accumulator
+    std::vector<int64_t> fixed;  // streaming sums of the frame when deterministic, 3 per pixel
+    bool denoise = false;   // filter the frame before presenting it, guided by the G-buffer
+    bool record_gbuffer = false;      // keep the primary hits for passes after the frame, implied by the two below
+    GBufferView view = GBUFFER_COLOR; // what is presented, the image or one G-buffer channel
+    GBuffer gbuffer;        // primary hits, laid out like the framebuffer
+    Denoiser denoiser;
+    bool upscale = false;   // present frames traced at scale > 1 through the upscaler instead of as blocks
+    Upscaler upscaler;
+    std::vector<uint32_t> screen_pixels; // the upscaled frame, uploaded to screen
+    Texture2D screen = {};
+    int scale = 0;          // the framebuffer layout depends on it
+    long stolen = 0;        // tiles rendered by a worker of another node, over all frames
+
+    bool needs_gbuffer() const { return record_gbuffer || denoise || upscale || view != GBUFFER_COLOR; }
+};
+
+// Angle covered by a pixel of the image downscaled by scale, the spread of the primary ray cones
+float pixel_angle(int scale) {
+    return 2 * tan(fov / 2.) / (height / scale);
+}
+
+// Direction of the primary ray through pixel (i, j) of the image downscaled by scale
+Vec3f camera_dir(int i, int j, int scale) {
+    float x = (2 * (i + 0.5) / (width / scale) - 1) * tan(fov / 2.) * (width / scale) / (height / scale);
+    float y = -(2 * (j + 0.5) / (height / scale) - 1) * tan(fov / 2.);
+    return Vec3f(x, y, -1).normalize();
+}
+
+// Where streamed rays add their color. Floating point sums depend on the order the rays of a pixel finish in,
+// which changes with scheduling; when deterministic they go to 32.32 fixed point sums instead, whose integer adds
+// give the same result in any order, and resolve() turns them into the framebuffer once the frame is done
+struct Accumulator {
+    Vec3f* framebuffer;
+    int64_t* fixed; // null unless deterministic
+
+    void clear(uint32_t pixel) const {
+        if (fixed) fixed[3 * size_t(pixel)] = fixed[3 * size_t(pixel) + 1] = fixed[3 * size_t(pixel) + 2] = 0;
+        else framebuffer[pixel] = Vec3f(0, 0, 0);
+    }
 
-        diffuse_light_intensity += lights[i].intensity * std::max(0.f, light_dir * N);
-        specular_light_intensity += powf(std::max(0.f, -reflect(-light_dir, N) * dir), material.specular_exponent) * lights[i].intensity;
+    void add(uint32_t pixel, const Vec3f& c) const {
+        if (fixed) {
+            for (size_t i = 0; i < 3; i++) {
+                const int64_t v = std::llround(double(c[i]) * 4294967296.);
+                #pragma omp atomic
+                fixed[3 * size_t(pixel) + i] += v;
+            }
+            return;
+        }
+        Vec3f& p = framebuffer[pixel];
+        #pragma omp atomic
+        p.x += c.x;
+        #pragma omp atomic
+        p.y += c.y;
+        #pragma omp atomic
+        p.z += c.z;
     }
-    return material.diffuse_color * diffuse_light_intensity * material.albedo[0] + Vec3f(1., 1., 1.) * specular_light_intensity * material.albedo[1] + reflect_color * material.albedo[2] + refract_color * material.albedo[3];
+
+    // Converts the fixed point sums of the w x h pixels, rows stride apart
+    void resolve(int w, int h, size_t stride) const {
+        if (!fixed) return;
+        #pragma omp parallel for schedule(static)
+        for (int y = 0; y < h; y++) {
+            for (size_t p = y * stride; p < y * stride + w; p++)
+                framebuffer[p] = Vec3f(float(fixed[3 * p] * (1. / 4294967296.)), float(fixed[3 * p + 1] * (1. / 4294967296.)), float(fixed[3 * p + 2] * (1. / 4294967296.)));
+        }
+    }
+};
+
+// Streaming counterpart of cast_ray(): instead of recursing, a hit adds its direct lighting times the ray
+// throughput to the pixel and hands the reflected and refracted rays, with the throughput scaled by their
+// albedo, to emit. Summed over all rays this is the same color the recursion computes. t and prim are the hit,
+// hit is as in cast_ray()
+template <bool Reflect, bool Refract, typename SceneT, typename Emit> void trace_stream_ray(const QueuedRay& ray, const float& t, const int& prim, const SceneT& scene, const Accumulator& accum, PrimaryHit* hit, Emit& emit) {
+    const Vec3f& tp = ray.throughput;
+    if (t >= 1000) {
+        if (hit) *hit = PrimaryHit();
+        Vec3f c = background(ray.dir, ray.cone, scene);
+        accum.add(ray.pixel, Vec3f(tp.x * c.x, tp.y * c.y, tp.z * c.z));
+        return;
+    }
+
+    const SurfaceInteraction si = surface_interaction(ray.orig, ray.dir, t, prim, scene, ray.cone);
+    const MMaterial& material = si.material;
+    if (hit) *hit = primary_hit(t, si, prim);
+    QueuedRay next;
+    next.pixel = ray.pixel;
+    next.depth = ray.depth - 1;
+    next.cone = secondary_cone(ray.cone, t, si);
+    if (Reflect && material.albedo[2] != 0) {
+        next.dir = reflect(ray.dir, si.N).normalize();
+        spawn_ray(si, prim, next.dir, next.orig, next.ignore);
+        next.throughput = tp * material.albedo[2];
+        emit(next);
+    }
+    if (Refract && material.albedo[3] != 0) {
+        next.dir = refract(ray.dir, si.N, material.refractive_index).normalize();
+        spawn_ray(si, prim, next.dir, next.orig, next.ignore);
+        next.throughput = tp * material.albedo[3];
+        emit(next);
+    }
+    Vec3f c = direct_lighting(si, prim, ray.dir, scene);
+    accum.add(ray.pixel, Vec3f(tp.x * c.x, tp.y * c.y, tp.z * c.z));
 }
 
-void render(const std::vector<Sphere>& spheres, const std::vector<Light>& lights, int scale, int maxDepth) {
-    std::vector<Vec3f> framebuffer((width * height) / scale);
+// Streaming render loop of one worker. Filled ray chunks are traced first, new tiles of primary rays are only
+// started when the queue is empty, which keeps the chunk pool small. Secondary rays are batched per worker and
+// submitted before the chunk that spawned them is released, so pending only reaches zero once every ray is done.
+// When the pool runs out a ray is finished by the recursive kernel, except in deterministic mode: which rays take
+// that path depends on scheduling and the kernel rounds differently, so there the ray waits for a free chunk
+template <bool Reflect, bool Refract, typename SceneT> void render_stream(const SceneT& scene, RenderTarget<SceneT>& target, int node, int scale, int maxDepth, int tile_size, int tiles_x) {
+    RayStream& stream = target.stream;
+    const Accumulator accum = {target.framebuffer.data, target.deterministic ? target.fixed.data() : nullptr};
+    GBuffer* gbuffer = target.needs_gbuffer() ? &target.gbuffer : nullptr;
+    const int w = width / scale, h = height / scale, primary_depth = std::min(maxDepth, 4);
+    int out = -1; // chunk being filled by this worker
+    PrimaryHit hits[RayChunk::capacity]; // G-buffer records of the primary rays in the chunk being traced
+    std::vector<QueuedRay> rays(size_t(tile_size) * tile_size); // primary rays of the tile being started
+    std::vector<QueuedRay> deferred, retry; // rays emitted while the pool was exhausted, deterministic mode only
 
-    // #pragma omp parallel for
-    for (size_t j = 0; j < height / scale; j++) {
-        for (size_t i = 0; i < width / scale; i++) {
-            float x = (2 * (i + 0.5) / (width / scale) - 1) * tan(fov / 2.) * (width / scale) / (height / scale);
-            float y = -(2 * (j + 0.5) / (height / scale) - 1) * tan(fov / 2.);
-            Vec3f dir = Vec3f(x, y, -1).normalize();
-            framebuffer[i + j * width] = cast_ray(Vec3f(0, 0, 0), dir, spheres, lights, 0, maxDepth);
+    auto flush = [&]() {
+        if (out >= 0 && stream.chunks[out].size) stream.submit(out);
+        else if (out >= 0) stream.release_empty(out);
+        out = -1;
+    };
+    auto emit = [&](const QueuedRay& ray) {
+        if (ray.depth < 0) { // out of bounces, cast_ray<-1> returns the background
+            Vec3f c = background(ray.dir, ray.cone, scene);
+            accum.add(ray.pixel, Vec3f(ray.throughput.x * c.x, ray.throughput.y * c.y, ray.throughput.z * c.z));
+            return;
+        }
+        if (out < 0) out = stream.acquire();
+        if (out < 0 && target.deterministic) { // pool exhausted, queued once chunks are released
+            deferred.push_back(ray);
+            return;
+        }
+        if (out < 0) { // pool exhausted, finish the ray with the recursive kernel
+            PrimaryHit hit;
+            const bool primary = gbuffer && ray.depth == primary_depth;
+            Vec3f c = trace_kernel<Reflect, Refract, SceneT>(ray.depth)(ray.orig, ray.dir, scene, ray.ignore, ray.cone, primary ? &hit : nullptr);
+            if (primary) gbuffer->write(ray.pixel, hit);
+            accum.add(ray.pixel, Vec3f(ray.throughput.x * c.x, ray.throughput.y * c.y, ray.throughput.z * c.z));
+            return;
         }
+        stream.chunks[out].push(ray);
+        if (stream.chunks[out].full()) flush();
+    };
+
+    for (;;) {
+        uint32_t c;
+        int tile;
+        if (!deferred.empty()) { // before taking more work, this worker holds no chunk now
+            PerfScope scope(STAGE_TRACE);
+            retry.swap(deferred);
+            for (const QueuedRay& ray : retry) emit(ray);
+            retry.clear();
+            flush();
+        }
+        if (stream.full_chunks.pop(c)) {
+            PerfScope scope(STAGE_TRACE);
+            const RayChunk& chunk = stream.chunks[c];
+            float t[RayChunk::capacity];
+            int prim[RayChunk::capacity];
+            scene_intersect(chunk, scene, t, prim);
+            for (int k = 0; k < chunk.size; k++) {
+                PrimaryHit* hit = gbuffer && chunk.depth[k] == primary_depth ? &hits[k] : nullptr;
+                trace_stream_ray<Reflect, Refract>(chunk[k], t[k], prim[k], scene, accum, hit, emit);
+            }
+            // Primary rays sit in the chunk in scanline order within their tile, stored as runs of adjacent pixels
+            for (int k = 0, n; gbuffer && k < chunk.size; k += n) {
+                for (n = 1; k + n < chunk.size && chunk.pixel[k + n] == chunk.pixel[k] + n && chunk.depth[k + n] == chunk.depth[k]; n++);
+                if (chunk.depth[k] == primary_depth) gbuffer->write(chunk.pixel[k], n, 1, width, hits + k);
+            }
+            flush();
+            stream.release(int(c));
+        }
+        else if (deferred.empty() && (tile = target.tiles.next(node)) >= 0) {
+            const int i0 = (tile % tiles_x) * tile_size, j0 = (tile / tiles_x) * tile_size;
+            int n = 0;
+            {
+                PerfScope scope(STAGE_RAYGEN);
+                QueuedRay ray;
+                ray.orig = Vec3f(0, 0, 0);
+                ray.throughput = Vec3f(1, 1, 1);
+                ray.ignore = NO_HIT;
+                ray.depth = primary_depth;
+                ray.cone.spread = pixel_angle(scale);
+                for (int j = j0; j < std::min(j0 + tile_size, h); j++) {
+                    for (int i = i0; i < std::min(i0 + tile_size, w); i++) {
+                        ray.pixel = uint32_t(i + j * width);
+                        accum.clear(ray.pixel); // accumulated into from here on
+                        ray.dir = camera_dir(i, j, scale);
+                        rays[n++] = ray;
+                    }
+                }
+            }
+            // Queueing counts as tracing, as for secondary rays, and so does the recursive fallback emit() takes
+            // when the chunk pool runs out
+            PerfScope scope(STAGE_TRACE);
+            for (int k = 0; k < n; k++) emit(rays[k]);
+            flush();
+        }
+        else if (deferred.empty() && stream.pending.load(std::memory_order_acquire) == 0) break;
+        else std::this_thread::yield();
+    }
+}
+
+template <bool Reflect = true, bool Refract = true, typename SceneT> void render(const SceneT& scene, RenderTarget<SceneT>& target, int scale, int maxDepth) {
+    const int tile_size = 16;
+    const int w = width / scale, h = height / scale;
+    const int tiles_x = (w + tile_size - 1) / tile_size, tiles_y = (h + tile_size - 1) / tile_size;
+    const int nodes = target.topology.nodes();
+    const bool touch = target.scale != scale;
+    if (touch) {
+        target.framebuffer.allocate(size_t(width) * h + 1); // rows are width apart, plus the pixel the present loop reads past the last one
+        target.scale = scale;
+    }
+    if (target.needs_gbuffer() && target.gbuffer.size() != target.framebuffer.size) target.gbuffer.resize(target.framebuffer.size);
+    if (target.streaming && target.deterministic) target.fixed.resize(3 * target.framebuffer.size);
+    target.replicas.resize(nodes - 1);
+    target.tiles.reset(tiles_x * tiles_y, nodes);
+    NumaBuffer<Vec3f>& framebuffer = target.framebuffer;
+    TraceKernel<SceneT> trace = trace_kernel<Reflect, Refract, SceneT>(maxDepth);
+    GBuffer* gbuffer = target.needs_gbuffer() ? &target.gbuffer : nullptr;
+    RayCone primary;
+    primary.spread = pixel_angle(scale);
+
+    #pragma omp parallel
+    {
+        const int worker = worker_id(), count = worker_count();
+        const int node = target.topology.node_of_worker(worker, count);
+        target.topology.bind_thread(node);
+
+        // The first worker of each node places the node's framebuffer stripe and refreshes its scene replica if the
+        // scene was committed since
+        if (worker == 0 || target.topology.node_of_worker(worker - 1, count) != node) {
+            if (touch) {
+                size_t first = size_t(target.tiles.begin(node) / tiles_x) * tile_size * width;
+                size_t last = node == nodes - 1 ? framebuffer.size : size_t(target.tiles.begin(node + 1) / tiles_x) * tile_size * width;
+                framebuffer.first_touch(std::min(first, framebuffer.size), std::min(last, framebuffer.size));
+            }
+            if (node > 0) {
+                if (!target.replicas[node - 1]) target.replicas[node - 1].reset(new SceneT(scene));
+                else if (target.replicas[node - 1]->version != scene.version) *target.replicas[node - 1] = scene;
+            }
+        }
+        #pragma omp barrier
+        const SceneT& local = node > 0 ? *target.replicas[node - 1] : scene;
+
+        PrimaryHit hits[tile_size * tile_size]; // G-buffer records of the tile being traced, stored in one go
+        Vec3f dirs[tile_size * tile_size];      // camera rays of the tile
+        if (target.streaming) render_stream<Reflect, Refract>(local, target, node, scale, maxDepth, tile_size, tiles_x);
+        else for (int tile; (tile = target.tiles.next(node)) >= 0;) {
+            const int i0 = (tile % tiles_x) * tile_size, j0 = (tile / tiles_x) * tile_size;
+            const int i1 = std::min(i0 + tile_size, w), j1 = std::min(j0 + tile_size, h);
+            { // stages are timed per tile, counter reads per pixel would cost more than the camera rays
+                PerfScope scope(STAGE_RAYGEN);
+                for (int j = j0; j < j1; j++)
+                    for (int i = i0; i < i1; i++) dirs[(j - j0) * (i1 - i0) + i - i0] = camera_dir(i, j, scale);
+            }
+            {
+                PerfScope scope(STAGE_TRACE);
+                for (int j = j0; j < j1; j++) {
+                    for (int i = i0; i < i1; i++) {
+                        const int k = (j - j0) * (i1 - i0) + i - i0;
+                        framebuffer[i + j * width] = trace(Vec3f(0, 0, 0), dirs[k], local, NO_HIT, primary, gbuffer ? &hits[k] : nullptr);
+                    }
+                }
+            }
+            if (gbuffer) gbuffer->write(i0 + j0 * width, i1 - i0, j1 - j0, width, hits);
+        }
+        if (gbuffer) GBuffer::fence();
     }
+    target.stolen += target.tiles.stolen.load();
+    if (target.streaming && target.deterministic) Accumulator{framebuffer.data, target.fixed.data()}.resolve(w, h, width);
+
+    if (target.denoise) {
+        PerfScope scope(STAGE_DENOISE);
+        target.denoiser.apply(framebuffer.data, *gbuffer, w, h, width);
+    }
+    if (target.view != GBUFFER_COLOR) gbuffer->show(target.view, framebuffer.data, w, h, width);
 
     // Simple rectangle drawing
     /*for (int i = 0; i < (height * width / scale); ++i) {
@@ -145,6 +860,18 @@ void render(const std::vector<Sphere>& spheres, const std::vector<Light>& lights
         DrawRectangle((i % width) * scale, (i / width) * scale, scale, scale, { (unsigned char)(255 * std::max(0.f, std::min(1.f, c[0]))), (unsigned char)(255 * std::max(0.f, std::min(1.f, c[1]))), (unsigned char)(255 * std::max(0.f, std::min(1.f, c[2]))), 255 });
     }*/
 
+    PerfScope present(STAGE_PRESENT);
+    if (target.upscale && scale > 1) {
+        if (!target.screen.id) {
+            target.screen_pixels.assign(size_t(width) * height, 0xff000000u);
+            target.screen = LoadTextureFromImage(Image{target.screen_pixels.data(), width, height, 1, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8});
+        }
+        target.upscaler.apply(framebuffer.data, *gbuffer, w, h, width, scale, target.screen_pixels.data(), width);
+        UpdateTexture(target.screen, target.screen_pixels.data());
+        DrawTexture(target.screen, 0, 0, WHITE);
+        return;
+    }
+
     // Contiguous rectangle drawing
     for (int row = 0; row < height / scale; row++) {
         int startIdx = row * width; // Start index of the current row in the framebuffer
@@ -183,29 +910,287 @@ void render(const std::vector<Sphere>& spheres, const std::vector<Light>& lights
     }
 }
 
-int main() {
+///// SCENE /////
+// The demo scene as constexpr data: materials, initial sphere placement and the fixed lights
+constexpr MMaterial      ivory(1.0, Vec4f(0.6, 0.3, 0.1, 0.0), Vec3f(0.4, 0.4, 0.3), 50.);
+constexpr MMaterial      glass(1.5, Vec4f(0.0, 0.5, 0.1, 0.8), Vec3f(0.6, 0.7, 0.8), 125.);
+constexpr MMaterial red_rubber(1.0, Vec4f(0.9, 0.1, 0.0, 0.0), Vec3f(0.3, 0.1, 0.1), 10.);
+constexpr MMaterial     mirror(1.0, Vec4f(0.0, 10.0, 0.8, 0.0), Vec3f(1.0, 1.0, 1.0), 1425.);
+
+constexpr std::array<Sphere, 4> demo_spheres = {
+    Sphere(Vec3f(-3, 0, -16), 2, ivory),
+    Sphere(Vec3f(-1.0, -1.5, -12), 2, glass),
+    Sphere(Vec3f(1.5, -0.5, -18), 3, red_rubber),
+    Sphere(Vec3f(7, 5, -18), 4, mirror),
+};
+
+constexpr std::array<Light, 3> demo_lights = {
+    Light(Vec3f(-20, 20, 20), 1.5),
+    Light(Vec3f(30, 50, -25), 1.8),
+    Light(Vec3f(30, 20, 30), 1.7),
+};
+
+// The same lights with soft shadows (--area-lights): a sphere, a rectangle and the third one left a point
+constexpr std::array<Light, demo_lights.size()> demo_area_lights = {
+    Light(Vec3f(-20, 20, 20), 3, 1.5),
+    Light(Vec3f(30, 50, -25), Vec3f(8, 0, 0), Vec3f(0, 0, 8), 1.8),
+    Light(Vec3f(30, 20, 30), 1.7),
+};
+
+// Material features used by a scene, so kernels can drop the reflection or refraction code entirely. The demo
+// scene has both a mirror and glass, so its kiosk build keeps both and is specialized on primitive and light
+// counts only; a scene of opaque, non-reflective materials gets kernels without any secondary rays
+template <size_t N> constexpr bool has_reflection(const std::array<Sphere, N>& spheres) {
+    for (size_t i = 0; i < N; i++) if (spheres[i].material.albedo.z != 0) return true;
+    return false;
+}
+
+template <size_t N> constexpr bool has_refraction(const std::array<Sphere, N>& spheres) {
+    for (size_t i = 0; i < N; i++) if (spheres[i].material.albedo.w != 0) return true;
+    return false;
+}
+
+// Random spheres filling the space behind the demo scene, a stand-in dataset for the out-of-core mode. With
+// clusters > 0 they are gathered around that many random points instead, about 2 units across
+std::vector<Sphere> sphere_field(size_t count, size_t clusters = 0) {
+    const MMaterial materials[] = {ivory, red_rubber, mirror, glass};
+    std::vector<Sphere> field;
+    field.reserve(count);
+    uint32_t state = 1;
+    auto random = [&state]() { state = state * 1664525u + 1013904223u; return (state >> 8) * (1.f / 16777216.f); }; // [0, 1)
+    auto point = [&random]() { return Vec3f(-60 + 120 * random(), -3.5f + 40 * random(), -40 - 200 * random()); };
+    std::vector<Vec3f> centers(clusters);
+    for (Vec3f& c : centers) c = point();
+    for (size_t i = 0; i < count; i++) {
+        Vec3f center = point();
+        if (clusters) { // sums of uniforms, roughly normal around the cluster's point
+            Vec3f offset(random() + random() + random() - 1.5f, random() + random() + random() - 1.5f, random() + random() + random() - 1.5f);
+            center = centers[i % clusters] + offset * 2.f;
+        }
+        field.push_back(Sphere(center, .1f + .4f * random(), materials[i % 4]));
+    }
+    return field;
+}
+
+// FNV-1a over the bits of the w x h pixels of image, rows stride apart: equal only for bit-identical frames
+uint64_t image_hash(const Vec3f* image, int w, int h, size_t stride) {
+    uint64_t hash = 14695981039346656037u;
+    for (int y = 0; y < h; y++) {
+        for (size_t p = y * stride; p < y * stride + w; p++) {
+            for (size_t i = 0; i < 3; i++) {
+                uint32_t bits;
+                std::memcpy(&bits, &image[p][i], sizeof(bits));
+                for (int b = 0; b < 32; b += 8) hash = (hash ^ ((bits >> b) & 255)) * 1099511628211u;
+            }
+        }
+    }
+    return hash;
+}
+
+// The same over RGBA pixels, what the upscaler presents
+uint64_t image_hash(const uint32_t* image, int w, int h, size_t stride) {
+    uint64_t hash = 14695981039346656037u;
+    for (int y = 0; y < h; y++)
+        for (size_t p = y * stride; p < y * stride + w; p++)
+            for (int b = 0; b < 32; b += 8) hash = (hash ^ ((image[p] >> b) & 255)) * 1099511628211u;
+    return hash;
+}
+
+// Writes the frame last presented, width x height, to a binary PPM: the upscaled pixels, or else the framebuffer's
+// pixels as scale x scale blocks, color corrected as the present does
+template <typename SceneT> bool save_frame(const std::string& path, const RenderTarget<SceneT>& target, int scale) {
+    std::ofstream file(path, std::ios::binary);
+    file << "P6\n" << width << " " << height << "\n255\n";
+    std::vector<unsigned char> row(3 * size_t(width));
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            unsigned char* rgb = &row[3 * size_t(x)];
+            if (target.upscale && scale > 1) {
+                const uint32_t p = target.screen_pixels[size_t(y) * width + x];
+                for (int k = 0; k < 3; k++) rgb[k] = (p >> 8 * k) & 255;
+                continue;
+            }
+            Vec3f c = target.framebuffer[(y / scale) * width + x / scale];
+            float max = std::max(c[0], std::max(c[1], c[2]));
+            if (max > 1) c = c * (1. / max);
+            for (int k = 0; k < 3; k++) rgb[k] = (unsigned char)(255 * c[k]);
+        }
+        file.write(reinterpret_cast<const char*>(row.data()), row.size());
+    }
+    return bool(file);
+}
+
+// The number following argv[a], which must lie in [min, max]; a moves past it. A missing or malformed value ends
+// the program with exit status 2, as stoi() and stoul() would with an uncaught exception. option names the option
+// in the message when argv[a] is an earlier value of it
+template <typename T> T option_number(int argc, char** argv, int& a, T min, T max, const char* option = nullptr) {
+    T value{};
+    const char* text = a + 1 < argc ? argv[a + 1] : "";
+    const char* end = text + std::strlen(text);
+    const std::from_chars_result parsed = std::from_chars(text, end, value);
+    if (a + 1 >= argc || parsed.ec != std::errc() || parsed.ptr != end || !(value >= min && value <= max)) {
+        std::cerr << (option ? option : argv[a]) << " takes a number from " << min << " to " << max << (a + 1 < argc ? std::string(", not ") + text : "") << std::endl;
+        std::exit(2);
+    }
+    a++;
+    return value;
+}
+
+// Index of the name following argv[a] among names; a moves past it. Anything else ends the program as
+// option_number() does
+template <size_t N> int option_choice(int argc, char** argv, int& a, const char* const (&names)[N], const char* option = nullptr) {
+    for (size_t k = 0; a + 1 < argc && k < N; k++) {
+        if (argv[a + 1] == std::string(names[k])) {
+            a++;
+            return int(k);
+        }
+    }
+    std::cerr << (option ? option : argv[a]) << " takes one of";
+    for (const char* name : names) std::cerr << ' ' << name;
+    std::cerr << (a + 1 < argc ? std::string(", not ") + argv[a + 1] : "") << std::endl;
+    std::exit(2);
+}
+
+int main(int argc, char** argv) {
     ///// INIT /////
     SetConfigFlags(FLAG_VSYNC_HINT);
     InitWindow(width, height, "TINY_RAY_TRACER");
 
-    MMaterial      ivory(1.0, Vec4f(0.6, 0.3, 0.1, 0.0), Vec3f(0.4, 0.4, 0.3), 50.);
-    MMaterial      glass(1.5, Vec4f(0.0, 0.5, 0.1, 0.8), Vec3f(0.6, 0.7, 0.8), 125.);
-    MMaterial red_rubber(1.0, Vec4f(0.9, 0.1, 0.0, 0.0), Vec3f(0.3, 0.1, 0.1), 10.);
-    MMaterial     mirror(1.0, Vec4f(0.0, 10.0, 0.8, 0.0), Vec3f(1.0, 1.0, 1.0), 1425.);
+#ifdef TINYRT_CONSTEXPR_SCENE
+    // Kiosk builds: primitive counts and material features are fixed at compile time, only positions animate
+    FixedScene<demo_spheres.size(), demo_lights.size()> scene = { demo_spheres, demo_lights };
+    for (int a = 1; a < argc; a++) if (std::string(argv[a]) == "--area-lights") scene.lights = demo_area_lights;
+#else
+    Scene scene;
+    scene.spheres.assign(demo_spheres.begin(), demo_spheres.end());
+    scene.lights.assign(demo_lights.begin(), demo_lights.end());
+    for (int a = 1; a < argc; a++) if (std::string(argv[a]) == "--area-lights") scene.lights.assign(demo_area_lights.begin(), demo_area_lights.end());
+
+    // --env <file.hdr> replaces the sky color with an equirectangular environment map
+    for (int a = 1; a + 1 < argc; a++) {
+        if (std::string(argv[a]) != "--env") continue;
+        std::shared_ptr<EnvironmentMap> environment = std::make_shared<EnvironmentMap>();
+        if (environment->load(argv[a + 1])) scene.environment = environment;
+        else std::cerr << "can't load " << argv[a + 1] << std::endl;
+    }
+
+    // --texture <sphere> <diffuse|specular|normal> <file> maps an image (.ppm or .hdr) onto a sphere of the demo scene,
+    // --texture-budget <MB> bounds the memory of all mip chains
+    std::shared_ptr<TextureCache> textures = std::make_shared<TextureCache>();
+    for (int a = 1; a < argc; a++) if (std::string(argv[a]) == "--texture-budget") textures->budget = option_number(argc, argv, a, size_t(0), size_t(1) << 30) << 20;
+    for (int a = 1; a < argc; a++) {
+        if (std::string(argv[a]) != "--texture") continue;
+        const size_t sphere = option_number(argc, argv, a, size_t(0), scene.spheres.size() - 1);
+        const char* const kinds[] = {"diffuse", "specular", "normal"};
+        const int kind = option_choice(argc, argv, a, kinds, "--texture");
+        if (a + 1 >= argc) {
+            std::cerr << "--texture takes a sphere, a map and a file" << std::endl;
+            return 2;
+        }
+        int id = textures->load(argv[++a]);
+        if (id < 0) {
+            std::cerr << "can't map " << argv[a] << " onto sphere " << sphere << std::endl;
+            continue;
+        }
+        MMaterial& material = scene.spheres[sphere].material;
+        if (kind == 0) material.diffuse_map = int16_t(id);
+        else if (kind == 1) material.specular_map = int16_t(id);
+        else material.normal_map = int16_t(id);
+        scene.textures = textures;
+    }
+
+    // --spheres <count> adds a field of small spheres to the scene itself, the workload LOD proxies are for, and
+    // --clusters <n> gathers them into n clusters. --accel <linear|grid|bvh|bvh4|bvh8> starts with that structure,
+    // --lod <pixels> with that LOD threshold (bvh only, as L cycles it) and --interleave with streamed chunks
+    // traversing it interleaved (as C toggles it); --prefetch-linear <n> and --prefetch-tree <n> set the software
+    // prefetch distances
+    size_t spheres = 0, clusters = 0;
+    for (int a = 1; a < argc; a++) {
+        std::string arg = argv[a];
+        if (arg == "--spheres") spheres = option_number(argc, argv, a, size_t(0), size_t(1) << 30);
+        else if (arg == "--clusters") clusters = option_number(argc, argv, a, size_t(0), size_t(1) << 30);
+        else if (arg == "--lod") scene.lod_pixels = option_number(argc, argv, a, 0.f, 1e6f);
+        else if (arg == "--interleave") scene.interleave = true;
+        else if (arg == "--prefetch-linear") scene.prefetch_linear = option_number(argc, argv, a, 0, 1 << 16);
+        else if (arg == "--prefetch-tree") scene.prefetch_tree = option_number(argc, argv, a, 0, 1 << 16);
+        else if (arg == "--accel") scene.accel = Accel(option_choice(argc, argv, a, accel_names));
+    }
+    if (spheres) {
+        std::vector<Sphere> field = sphere_field(spheres, clusters);
+        scene.spheres.insert(scene.spheres.end(), field.begin(), field.end());
+    }
 
-    std::vector<Sphere> spheres;
-    spheres.push_back(Sphere(Vec3f(-3, 0, -16), 2, ivory));
-    spheres.push_back(Sphere(Vec3f(-1.0, -1.5, -12), 2, glass));
-    spheres.push_back(Sphere(Vec3f(1.5, -0.5, -18), 3, red_rubber));
-    spheres.push_back(Sphere(Vec3f(7, 5, -18), 4, mirror));
+    // Out-of-core sphere field: --bricks <file> opens a brick file, --make-bricks <file> <count> writes a random one
+    // first, --brick-budget <MB> bounds what stays resident. Only --streaming queues the field's rays per brick, the
+    // recursive renderer and all shadow rays trace it one ray at a time
+    std::string bricks_path;
+    size_t field_count = 0, brick_budget = 1024;
+    for (int a = 1; a < argc; a++) {
+        std::string arg = argv[a];
+        if (arg == "--bricks" && a + 1 < argc) bricks_path = argv[++a];
+        else if (arg == "--make-bricks" && a + 1 < argc) { bricks_path = argv[++a]; field_count = option_number(argc, argv, a, size_t(1), size_t(1) << 40, "--make-bricks"); }
+        else if (arg == "--brick-budget") brick_budget = option_number(argc, argv, a, size_t(1), size_t(1) << 30);
+    }
+    if (field_count && !BrickedScene<Sphere>::write(bricks_path, sphere_field(field_count)))
+        std::cerr << "can't write " << bricks_path << std::endl;
+    if (!bricks_path.empty()) {
+        std::shared_ptr<BrickedScene<Sphere>> field = std::make_shared<BrickedScene<Sphere>>();
+        if (!field->open(bricks_path, brick_budget << 20)) std::cerr << "can't open " << bricks_path << std::endl;
+        else if (field->size() > size_t(std::numeric_limits<int>::max()) - scene.spheres.size()) // scene-wide ids are ints
+            std::cerr << bricks_path << " holds more spheres than scene ids can number" << std::endl;
+        else scene.field = field;
+    }
+#endif
+    RenderTarget<decltype(scene)> target;
+    NumaStats numa_start = NumaStats::read();
 
-    std::vector<Light>  lights;
-    lights.push_back(Light(Vec3f(-20, 20, 20), 1.5));
-    lights.push_back(Light(Vec3f(30, 50, -25), 1.8));
-    lights.push_back(Light(Vec3f(30, 20, 30), 1.7));
+    // --deterministic renders bit-identical frames whatever the thread count and scheduling. --streaming starts out
+    // tracing through the ray queue, --denoise with the denoiser on, --upscale presenting through the upscaler and
+    // --gbuffer <color|depth|normal|id|albedo> presenting that channel, as S, D, U and G switch them. --hash <frames>
+    // renders that many frames of the animation deterministically, prints the hash of each and of them all, and
+    // exits; --expect <hash> makes that exit status 1 unless the hash of them all matches, the regression check
+    // ctest runs against tests/render_hashes.txt. --save <file.ppm> writes the last frame as presented, --chunks <n>
+    // sizes the pool of streamed ray chunks (1024)
+    int hash_frames = 0;
+    std::string expected_hash, save_path;
+    for (int a = 1; a < argc; a++) {
+        std::string arg = argv[a];
+        if (arg == "--deterministic") target.deterministic = true;
+        else if (arg == "--streaming") target.streaming = true;
+        else if (arg == "--denoise") target.denoise = true;
+        else if (arg == "--upscale") target.upscale = true;
+        else if (arg == "--gbuffer") target.view = GBufferView(option_choice(argc, argv, a, gbuffer_view_names));
+        else if (arg == "--hash") { hash_frames = option_number(argc, argv, a, 1, 1 << 20); target.deterministic = true; }
+        else if (arg == "--expect" && a + 1 < argc) expected_hash = argv[++a];
+        else if (arg == "--save" && a + 1 < argc) save_path = argv[++a];
+        else if (arg == "--chunks") target.stream.reset(option_number(argc, argv, a, size_t(1), size_t(1) << 20));
+    }
+#ifndef TINYRT_CONSTEXPR_SCENE
+    // --irradiance-cache starts with the cache on, as I turns it on; deterministic runs ignore both
+    for (int a = 1; a < argc; a++) if (argv[a] == std::string("--irradiance-cache")) scene.use_irradiance_cache = !target.deterministic;
+#endif
+    int frame = 0;
+    uint64_t run_hash = 14695981039346656037u;
 
     int scale = 8;     // 8
     int maxDepth = 4;  // 4
+
+    // --scale <n> and --depth <n> set the starting resolution divider (1 to 16, a power of two) and bounces (1 to 4),
+    // --frames <n> stops after n frames and prints how long render() and the scene commit took, what benchmarks read
+    int frames = 0;
+    for (int a = 1; a < argc; a++) {
+        std::string arg = argv[a];
+        if (arg == "--scale") {
+            scale = option_number(argc, argv, a, 1, 16);
+            if (scale & (scale - 1)) {
+                std::cerr << "--scale takes a power of two, not " << scale << std::endl;
+                return 2;
+            }
+        }
+        else if (arg == "--depth") maxDepth = option_number(argc, argv, a, 1, 4);
+        else if (arg == "--frames") frames = option_number(argc, argv, a, 0, 1 << 20);
+    }
+    std::vector<double> frame_ms, commit_ms; // of render() and of Scene::commit(), which rebuilds the acceleration structure
     
     int angle = 0;
 
@@ -215,29 +1200,90 @@ int main() {
     {
         ///// UPDATE /////
         angle = (angle + 4) % 360;
-        spheres[0].center[0] = cos(angle * DEG2RAD) * 8;
-        spheres[0].center[2] = sin(angle * DEG2RAD) * 8 - 16;
+        scene.spheres[0].set_center(Vec3f(cos(angle * DEG2RAD) * 8, scene.spheres[0].center.y, sin(angle * DEG2RAD) * 8 - 16));
         // spheres[0].center[0] = GetMouseX() / 64 - 8;
         // spheres[0].center[2] = GetMouseY() / 48 - 24;
         if (scale > 1 && IsKeyPressed(KEY_LEFT)) { scale /= 2; }
         else if (scale < 16 && IsKeyPressed(KEY_RIGHT)) { scale *= 2; }
         if (maxDepth > 1 && IsKeyPressed(KEY_DOWN)) { maxDepth -= 1; }
         else if (maxDepth < 4 && IsKeyPressed(KEY_UP)) { maxDepth += 1; }
+#ifndef TINYRT_CONSTEXPR_SCENE
+        if (IsKeyPressed(KEY_A)) { scene.accel = Accel((scene.accel + 1) % ACCEL_COUNT); }
+        if (IsKeyPressed(KEY_B)) { scene.bvh_builder = BVHBuilder((scene.bvh_builder + 1) % BVH_BUILDER_COUNT); }
+        if (IsKeyPressed(KEY_I) && !target.deterministic) { scene.use_irradiance_cache = !scene.use_irradiance_cache; } // lookups see whichever records were inserted first
+        if (IsKeyPressed(KEY_C)) { scene.interleave = !scene.interleave; }
+        if (IsKeyPressed(KEY_L)) { scene.lod_pixels = scene.lod_pixels >= 4 ? 0 : std::max(1.f, scene.lod_pixels * 2); } // off, 1, 2, 4 pixels
+        scene.pixel_size = pixel_angle(scale);
+#endif
+        if (IsKeyPressed(KEY_S)) { target.streaming = !target.streaming; }
+        if (IsKeyPressed(KEY_D)) { target.denoise = !target.denoise; }
+        if (IsKeyPressed(KEY_U)) { target.upscale = !target.upscale; }
+        if (IsKeyPressed(KEY_G)) { target.view = GBufferView((target.view + 1) % GBUFFER_VIEW_COUNT); }
+        auto commit_start = std::chrono::steady_clock::now();
+        scene.commit();
+        if (frames) commit_ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - commit_start).count());
 
         ///// DRAW /////
         BeginDrawing();
         ClearBackground(BLACK);
 
-        render(spheres, lights, scale, maxDepth);
+        auto start = std::chrono::steady_clock::now();
+#ifdef TINYRT_CONSTEXPR_SCENE
+        render<has_reflection(demo_spheres), has_refraction(demo_spheres)>(scene, target, scale, maxDepth);
+#else
+        render(scene, target, scale, maxDepth);
+#endif
+        if (frames) frame_ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
 
         // DrawRectangle(0, 0, 90, 80, BLACK);
         // DrawFPS(10, 10);
         // DrawText(std::to_string(scale).c_str(), 10, 30, 20, GREEN);
         // DrawText(std::to_string(maxDepth).c_str(), 10, 50, 20, GREEN);
         EndDrawing();
+        perf_frame_end();
+        if (hash_frames) {
+            uint64_t hash = image_hash(target.framebuffer.data, width / scale, height / scale, width);
+            if (target.upscale && scale > 1) hash = (hash ^ image_hash(target.screen_pixels.data(), width, height, width)) * 1099511628211u;
+            run_hash = (run_hash ^ hash) * 1099511628211u;
+            std::cout << "frame " << frame << " hash " << std::hex << hash << std::dec << std::endl;
+            if (++frame == hash_frames) break;
+        }
+        if (frames && int(frame_ms.size()) == frames) break;
+#ifndef TINYRT_CONSTEXPR_SCENE
+        if (scene.field) {
+            BrickedScene<Sphere>::IOStats io = scene.field->take_stats();
+            std::cerr << "bricks: " << io.bricks_loaded << " loaded, " << (io.bytes_loaded >> 20) << "MB paged in, "
+                      << (io.bytes_read >> 20) << "MB read from storage, " << (io.bytes_resident >> 20) << "MB resident" << std::endl;
+        }
+#endif
     }
 
     ///// SHUT /////
+    if (frames) {
+        std::sort(frame_ms.begin(), frame_ms.end());
+        std::sort(commit_ms.begin(), commit_ms.end());
+        std::cout << frame_ms.size() << " frames at scale " << scale << ", depth " << maxDepth << ": render median "
+                  << frame_ms[frame_ms.size() / 2] << " ms, best " << frame_ms[0] << " ms; commit median "
+                  << commit_ms[commit_ms.size() / 2] << " ms" << std::endl;
+    }
+    // numastat is system wide, so the remote share includes whatever else ran meanwhile
+    NumaStats numa = NumaStats::read() - numa_start;
+    std::cerr << "numa: " << target.topology.nodes() << " node(s), " << target.stolen << " tiles stolen, "
+              << numa.other_node << " pages placed off-node (" << 100 * numa.remote_fraction() << "%)" << std::endl;
+    if (huge_pages_enabled()) {
+        HugePageStats& huge = huge_page_stats();
+        std::cerr << "huge pages: " << (huge.explicit_bytes >> 20) << "MB explicit, " << (huge.transparent_bytes >> 20) << "MB transparent, "
+                  << (huge.regular_bytes >> 20) << "MB in small pages" << std::endl;
+    }
+    if (!save_path.empty() && target.scale && !save_frame(save_path, target, target.scale)) std::cerr << "can't write " << save_path << std::endl;
+    if (target.screen.id) UnloadTexture(target.screen);
     CloseWindow();
+    if (hash_frames) {
+        std::cout << "hash " << std::hex << run_hash << std::dec << std::endl;
+        if (!expected_hash.empty() && std::stoull(expected_hash, nullptr, 16) != run_hash) {
+            std::cerr << "hash mismatch, expected " << expected_hash << std::endl;
+            return 1;
+        }
+    }
     return 0;
 }
\ No newline at end of file
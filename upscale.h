@@ -0,0 +1,107 @@
+#ifndef __UPSCALE_H__
+#define __UPSCALE_H__
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include "geometry.h"
+#include "gbuffer.h"
+
+// Edge-aware upscaling of a frame traced at 1/scale resolution (joint bilateral upsampling, Kopf et al.): bilinear
+// interpolation whose taps only count when they saw the same primitive as the low resolution pixel the output pixel
+// falls in, at a similar depth, so surfaces are smooth but silhouettes don't bleed into what's behind them.
+// Separable: a horizontal pass over the low resolution rows, then a vertical pass over the output rows that reads
+// three planar rows at fixed offsets, a loop the compiler vectorizes. It also maps colors to bytes like the
+// rectangle present does, so its output can go straight to a texture
+struct Upscaler {
+    float sigma_depth = .25f; // relative depth difference tolerated between neighboring low resolution pixels
+
+    // Upscales the w x h pixels of image (rows stride apart) guided by gbuffer of the same layout into
+    // w * scale x h * scale RGBA pixels, rows out_stride pixels apart
+    void apply(const Vec3f* image, const GBuffer& gbuffer, int w, int h, size_t stride, int scale, uint32_t* out, size_t out_stride) {
+        const int W = w * scale, H = h * scale;
+        for (Plane<float>* plane : {&r, &g, &b, &depth, &depth_scale}) plane->resize(size_t(W) * h);
+        id.resize(size_t(W) * h);
+
+        // Horizontal: row j of the planes holds low resolution row j at output columns, with the guide of the
+        // low resolution pixel each column falls in
+        #pragma omp parallel for schedule(static)
+        for (int j = 0; j < h; j++) {
+            const size_t in = j * stride;
+            for (int x = 0; x < W; x++) {
+                int i0, i1;
+                float f;
+                taps(x, scale, w, i0, i1, f);
+                const size_t n = in + x / scale, p = size_t(j) * W + x;
+                const int32_t near = gbuffer.id[n];
+                const float z = near != -1 ? gbuffer.depth[n] : 0.f, zs = near != -1 ? 1 / (sigma_depth * z) : 0.f;
+                const float w0 = (1 - f) * guide(gbuffer, in + i0, near, z, zs), w1 = f * guide(gbuffer, in + i1, near, z, zs);
+                const float inv = 1 / (w0 + w1); // the pixel the column falls in is one of the taps and has weight >= 1/2
+                r[p] = (image[in + i0].x * w0 + image[in + i1].x * w1) * inv;
+                g[p] = (image[in + i0].y * w0 + image[in + i1].y * w1) * inv;
+                b[p] = (image[in + i0].z * w0 + image[in + i1].z * w1) * inv;
+                id[p] = near;
+                depth[p] = z;
+                depth_scale[p] = zs;
+            }
+        }
+
+        // Vertical, the same per column, then to bytes
+        #pragma omp parallel for schedule(static)
+        for (int y = 0; y < H; y++) {
+            int j0, j1;
+            float f1;
+            taps(y, scale, h, j0, j1, f1);
+            const float f0 = 1 - f1; // selected below without arithmetic, which keeps the loop if-convertible
+            const size_t row0 = size_t(j0) * W, row1 = size_t(j1) * W, near = size_t(y / scale) * W;
+            uint32_t* dst = out + y * out_stride;
+            #pragma omp simd
+            for (int x = 0; x < W; x++) {
+                const int32_t n = id[near + x];
+                const float z = depth[near + x], zs = depth_scale[near + x];
+                const float w0 = (id[row0 + x] == n ? f0 : 0.f) * falloff(std::fabs(depth[row0 + x] - z) * zs);
+                const float w1 = (id[row1 + x] == n ? f1 : 0.f) * falloff(std::fabs(depth[row1 + x] - z) * zs);
+                const float inv = 1 / (w0 + w1);
+                float cr = (r[row0 + x] * w0 + r[row1 + x] * w1) * inv;
+                float cg = (g[row0 + x] * w0 + g[row1 + x] * w1) * inv;
+                float cb = (b[row0 + x] * w0 + b[row1 + x] * w1) * inv;
+                float max = cr > cg ? cr : cg; // std::max() would return a reference into memory, which doesn't vectorize
+                max = max > cb ? max : cb;
+                const float k = 255 / (.5f * (max + 1 + std::fabs(max - 1))); // color correction of the present, max(1, max) without a branch
+                dst[x] = uint32_t(int32_t(cr * k) | int32_t(cg * k) << 8 | int32_t(cb * k) << 16) | 0xff000000u; // RGBA bytes in memory
+            }
+        }
+    }
+
+private:
+    Plane<float> r, g, b;             // after the horizontal pass, output columns by low resolution rows
+    Plane<float> depth, depth_scale;  // guide of each, as in Denoiser
+    Plane<int32_t> id;
+
+    // Low resolution taps i0 <= i1 of output coordinate x and the weight f of i1, clamped at the borders
+    static void taps(int x, int scale, int n, int& i0, int& i1, float& f) {
+        const float u = (x + .5f) / scale - .5f;
+        i0 = int(std::floor(u));
+        f = u - i0;
+        if (i0 < 0) { i0 = 0; f = 0; }
+        i1 = std::min(i0 + 1, n - 1);
+    }
+
+    // exp(-x) for x >= 0 as (1 - x/8)^8, as in Denoiser
+    static float falloff(float x) {
+        float f = .5f * (1.f - x * .125f + std::fabs(1.f - x * .125f));
+        f *= f;
+        f *= f;
+        return f * f;
+    }
+
+    // Weight of low resolution pixel q for an output pixel in the low resolution pixel with id near at depth z
+    static float guide(const GBuffer& gbuffer, size_t q, int32_t near, float z, float zs) {
+        if (gbuffer.id[q] != near) return 0.f;
+        return near != -1 ? falloff(std::fabs(gbuffer.depth[q] - z) * zs) : 1.f;
+    }
+};
+
+#endif //__UPSCALE_H__